@@ -5,6 +5,7 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <stdint.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -13,39 +14,98 @@
 #include <string.h>
 #include <time.h>
 #include <errno.h>
+#include <fcntl.h>
+#ifdef HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
 
 namespace redis { namespace{
-	void getTime(long *seconds, long *milliseconds){
-		struct timeval tv;
+	inline bool timerBefore(const TimeEvent* a, const TimeEvent* b){
+		return a->when < b->when;
+	}
 
-		gettimeofday(&tv, NULL);
-		*seconds = tv.tv_sec;
-		*milliseconds = tv.tv_usec/1000;
+	/* Consumes the wakeups written by EventLoop::post(). The posted tasks
+	* are run by processEvents() once the file events are handled. */
+	void readWakeup(EventLoop* eventLoop, int fd, void* clientData, int mask){
+		char buf[64];
+		while (read(fd,buf,sizeof(buf)) > 0) {}
 	}
 
-	void addMillisecondsToNow(long milliseconds, long *sec, long *ms) {
-		long cur_sec, cur_ms, when_sec, when_ms;
-		getTime(&cur_sec, &cur_ms);
-		when_sec = cur_sec + milliseconds/1000;
-		when_ms = cur_ms + milliseconds%1000;
-		if (when_ms >= 1000) {
-			when_sec ++;
-			when_ms -= 1000;
+	int setNonBlockCloExec(int fd){
+		int flags = fcntl(fd,F_GETFL);
+		if (flags == -1 || fcntl(fd,F_SETFL,flags|O_NONBLOCK) == -1) {
+			return AE_ERR;
+		}
+		if (fcntl(fd,F_SETFD,FD_CLOEXEC) == -1) {
+			return AE_ERR;
 		}
-		*sec = when_sec;
-		*ms = when_ms;
+		return AE_OK;
 	}
 }
 
+/* Intrusive multi-producer single-consumer queue (D. Vyukov). Producers
+* link a task with a single atomic exchange and never wait on each other
+* or on the loop; only the loop thread pops. A producer preempted between
+* the exchange and the link briefly hides the tasks behind its own: pop()
+* returns NULL and empty() reports false until the link is published. */
+struct TaskQueue{
+	LoopTask* head; /* last pushed task, shared by the producers */
+	LoopTask* tail; /* next task to pop, owned by the loop thread */
+	LoopTask stub;
+
+	TaskQueue()
+		:head(&stub),tail(&stub)
+	{}
+
+	void push(LoopTask* task){
+		__atomic_store_n(&task->next,(LoopTask*)NULL,__ATOMIC_RELAXED);
+		LoopTask* prev = __atomic_exchange_n(&this->head,task,__ATOMIC_ACQ_REL);
+		__atomic_store_n(&prev->next,task,__ATOMIC_RELEASE);
+	}
+
+	LoopTask* pop(){
+		LoopTask* tail = this->tail;
+		LoopTask* next = __atomic_load_n(&tail->next,__ATOMIC_ACQUIRE);
+		if (tail == &this->stub) {
+			if (next == NULL) {
+				return NULL;
+			}
+			this->tail = tail = next;
+			next = __atomic_load_n(&tail->next,__ATOMIC_ACQUIRE);
+		}
+		if (next) {
+			this->tail = next;
+			return tail;
+		}
+		if (tail != __atomic_load_n(&this->head,__ATOMIC_ACQUIRE)) {
+			return NULL; /* a push is half done */
+		}
+		/* 'tail' is the last task: put the stub behind it to unlink it */
+		this->push(&this->stub);
+		next = __atomic_load_n(&tail->next,__ATOMIC_ACQUIRE);
+		if (next) {
+			this->tail = next;
+			return tail;
+		}
+		return NULL;
+	}
+
+	bool empty() const{
+		return this->tail == &this->stub &&
+			__atomic_load_n(&this->stub.next,__ATOMIC_ACQUIRE) == NULL &&
+			__atomic_load_n(&this->head,__ATOMIC_ACQUIRE) == &this->stub;
+	}
+};
+
 struct PollCtrlBase{
 	FileEventVector_t events;
 	FiredEventVector_t fired;
-	
-	~PollCtrlBase(){
-		for (size_t i = 0 ; i < this->events.size(); ++ i){
-			delete this->events[i];
-		}
-	}
+	int api; /* requested AE_API_* */
+	PollStats stats;
+
+	PollCtrlBase()
+		:api(AE_API_DEFAULT)
+	{}
 
 	FiredEventVector_t& getFiredEvents(){
 		return this->fired;
@@ -62,6 +122,9 @@ struct PollCtrlBase{
 #else
 #ifdef HAVE_EPOLL
 #include "ae_epoll.cpp"
+#ifdef HAVE_IO_URING
+#include "ae_uring.cpp"
+#endif
 #else
 #ifdef HAVE_KQUEUE
 #include "ae_kqueue.cpp"
@@ -74,108 +137,513 @@ struct PollCtrlBase{
 
 EventLoop::EventLoop()
 :maxfd(-1),
+numfds(0),
+setsizeLimit(0),
 stop_flag(0),
 timeEventNextId(0),
-lastTime(time(NULL))
+coarseClock(0),
+now_us(0),
+processing(0),
+beforeSleepProc(NULL),
+wakeupPending(0),
+taskBacklog(0),
+threadBound(0),
+latencyTracking(0),
+busyPollUs(0),
+handlerStart(0),
+hookNextId(0),
+hookBacklog(0),
+hookDepth(0)
 {
 	this->poll = new PollCtrl();
+	this->tasks = new TaskQueue();
+	this->wakeupfd[0] = this->wakeupfd[1] = -1;
+	this->updateTime();
 }
 
 EventLoop::~EventLoop(){
-	for (size_t i = 0 ; i < this->timers.size(); ++ i){
-		delete this->timers[i];
+	for (TimeEventMap_t::iterator itr = this->timerIds.begin(), end = this->timerIds.end();
+		itr != end; ++ itr)
+	{
+		delete itr->second;
+	}
+	/* Tasks still queued are dropped without running */
+	for (LoopTask* task; (task = this->tasks->pop()) != NULL; ) {
+		delete task;
+	}
+	delete this->tasks;
+	if (this->wakeupfd[0] != -1) {
+		close(this->wakeupfd[0]);
+	}
+	if (this->wakeupfd[1] != -1 && this->wakeupfd[1] != this->wakeupfd[0]) {
+		close(this->wakeupfd[1]);
 	}
 	delete this->poll;
 }
 
-int EventLoop::init(int size){
-	return this->poll->init(size);
+int EventLoop::init(int size, int api){
+	this->poll->api = api;
+	if (this->poll->init(size) == AE_ERR) {
+		return AE_ERR;
+	}
+	return this->initWakeup();
+}
+
+/* Open the descriptor other threads write to in order to wake up the
+* poll: an eventfd where available, a non blocking pipe otherwise. */
+int EventLoop::initWakeup(){
+#ifdef HAVE_EVENTFD
+	int fd = eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+	if (fd != -1) {
+		this->wakeupfd[0] = this->wakeupfd[1] = fd;
+	}
+#endif
+	if (this->wakeupfd[0] == -1) {
+		int fds[2];
+		if (pipe(fds) == -1) {
+			return AE_ERR;
+		}
+		this->wakeupfd[0] = fds[0];
+		this->wakeupfd[1] = fds[1];
+		if (setNonBlockCloExec(fds[0]) == AE_ERR ||
+			setNonBlockCloExec(fds[1]) == AE_ERR)
+		{
+			return AE_ERR;
+		}
+	}
+	return this->createFileEvent(this->wakeupfd[0],AE_READABLE,readWakeup,NULL);
+}
+
+/* Queue 'task' to run on the loop thread, and wake the loop up if it is
+* sleeping in the poll. Safe to call from any thread; the loop takes the
+* ownership of the task and deletes it once run.
+*
+* Only the first post() after the loop drained its queue writes to the
+* wakeup descriptor, whatever the number of producers and tasks: the
+* others see the wakeup already pending and just link their task. */
+void EventLoop::post(LoopTask* task){
+	this->tasks->push(task);
+	if (__atomic_exchange_n(&this->wakeupPending,1,__ATOMIC_SEQ_CST) == 0 &&
+		this->wakeupfd[1] != -1)
+	{
+#ifdef HAVE_EVENTFD
+		if (this->wakeupfd[1] == this->wakeupfd[0]) {
+			uint64_t one = 1;
+			ssize_t nwritten = write(this->wakeupfd[1],&one,sizeof(one));
+			(void)nwritten;
+			return;
+		}
+#endif
+		/* A full pipe means a wakeup is pending anyway */
+		char one = 1;
+		ssize_t nwritten = write(this->wakeupfd[1],&one,1);
+		(void)nwritten;
+	}
+}
+
+/* Run 'task' right away when called from the loop thread, post it
+* otherwise. */
+void EventLoop::runInLoop(LoopTask* task){
+	if (this->isInLoopThread()) {
+		task->run(this);
+		delete task;
+	} else {
+		this->post(task);
+	}
+}
+
+/* Only known once main() runs: before that every caller is considered
+* foreign, and runInLoop() falls back to post(). */
+int EventLoop::isInLoopThread() const{
+	return this->threadBound && pthread_equal(this->thread,pthread_self());
+}
+
+/* Run up to AE_MAX_TASKS_PER_ITERATION posted tasks. When more are
+* queued, the backlog makes the next poll return immediately instead of
+* waiting for a wakeup that was already consumed. */
+int EventLoop::processTasks(){
+	if (!this->taskBacklog &&
+		!__atomic_load_n(&this->wakeupPending,__ATOMIC_ACQUIRE))
+	{
+		return 0;
+	}
+	/* Re-arm the wakeup before looking at the queue: a task linked after
+	* this point either is seen below or writes a new wakeup. */
+	__atomic_store_n(&this->wakeupPending,0,__ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	int processed = 0;
+	LoopTask* task;
+	while (processed < AE_MAX_TASKS_PER_ITERATION &&
+		(task = this->tasks->pop()) != NULL)
+	{
+		task->run(this);
+		delete task;
+		processed ++;
+	}
+	this->taskBacklog = !this->tasks->empty();
+	return processed;
+}
+
+long long EventLoop::monotonicTime(int coarse){
+#if defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+#if defined(CLOCK_MONOTONIC_COARSE)
+	clock_gettime(coarse ? CLOCK_MONOTONIC_COARSE : CLOCK_MONOTONIC,&ts);
+#else
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+#endif
+	return static_cast<long long>(ts.tv_sec)*1000000 + ts.tv_nsec/1000;
+#else
+	/* No monotonic clock: fall back to the wall clock */
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return static_cast<long long>(tv.tv_sec)*1000000 + tv.tv_usec;
+#endif
+}
+
+long long EventLoop::updateTime(){
+	this->now_us = monotonicTime(this->coarseClock);
+	return this->now_us;
+}
+
+/* What timer deadlines are relative to: the cached clock while the
+* events of an iteration are processed, so that the timers created by
+* its handlers agree with now(), and the real clock otherwise */
+long long EventLoop::timerBase(){
+	return this->processing ? this->now_us : this->updateTime();
 }
 
 const char* EventLoop::getName() const{
 	return this->poll->getName();
 }
 
+const PollStats& EventLoop::getPollStats() const{
+	return this->poll->stats;
+}
+
+void LatencyHistogram::reset(){
+	memset(this->buckets,0,sizeof(this->buckets));
+	this->count = this->sum = this->max = 0;
+}
+
+/* Upper bound of the bucket holding the p-th fraction of the samples,
+* capped by the largest sample seen. */
+long long LatencyHistogram::percentile(double p) const{
+	long long rank = static_cast<long long>(p * this->count + 0.5);
+	if (rank < 1) rank = 1;
+	long long seen = 0;
+	for (int i = 0; i < AE_HIST_BUCKETS; ++ i) {
+		seen += this->buckets[i];
+		if (seen >= rank) {
+			long long bound = i ? (1LL << i) - 1 : 0;
+			return bound < this->max ? bound : this->max;
+		}
+	}
+	return this->max;
+}
+
+void LoopStats::reset(){
+	this->iterations = 0;
+	this->spins = this->spinHits = this->blocks = 0;
+	this->yields = this->resumed = 0;
+	this->hookRuns = this->hookOverruns = 0;
+	this->pollWait.reset();
+	this->fileTime.reset();
+	this->timerTime.reset();
+	this->fired.reset();
+	this->timerLag.reset();
+}
+
+/* Append the histogram to 'buf' as the INFO field 'name', at 'pos'.
+* Past the end it keeps counting the length like snprintf(). */
+size_t LatencyHistogram::catInfo(char* buf, size_t len, size_t pos, const char* name) const{
+	int n = snprintf(pos < len ? buf+pos : NULL,pos < len ? len-pos : 0,
+		"%s:count=%lld,avg=%lld,p50=%lld,p99=%lld,p99.9=%lld,max=%lld\r\n",
+		name,this->count,this->mean(),this->percentile(0.5),this->percentile(0.99),
+		this->percentile(0.999),this->max);
+	return n < 0 ? pos : pos + n;
+}
+
+/* Write the loop statistics to 'buf' as INFO fields. Returns the length
+* the full text needs, like snprintf(): the output was truncated if it is
+* not lower than 'len'. */
+size_t EventLoop::getLoopStatsInfo(char* buf, size_t len) const{
+	const LoopStats& st = this->loopStats;
+	size_t pos = 0;
+	int n = snprintf(buf,len,
+		"# Eventloop\r\n"
+		"eventloop_api:%s\r\n"
+		"eventloop_latency_tracking:%d\r\n"
+		"eventloop_iterations:%lld\r\n"
+		"eventloop_busy_poll_usec:%lld\r\n"
+		"eventloop_spins:%lld\r\n"
+		"eventloop_spin_hits:%lld\r\n"
+		"eventloop_blocks:%lld\r\n"
+		"eventloop_yields:%lld\r\n"
+		"eventloop_resumed:%lld\r\n"
+		"eventloop_hook_runs:%lld\r\n"
+		"eventloop_hook_overruns:%lld\r\n",
+		this->getName(),this->latencyTracking,st.iterations,
+		this->busyPollUs,st.spins,st.spinHits,st.blocks,
+		st.yields,st.resumed,st.hookRuns,st.hookOverruns);
+	pos = n < 0 ? 0 : n;
+	pos = st.pollWait.catInfo(buf,len,pos,"eventloop_poll_wait_usec");
+	pos = st.fileTime.catInfo(buf,len,pos,"eventloop_file_handlers_usec");
+	pos = st.timerTime.catInfo(buf,len,pos,"eventloop_timers_usec");
+	pos = st.timerLag.catInfo(buf,len,pos,"eventloop_timer_lag_usec");
+	pos = st.fired.catInfo(buf,len,pos,"eventloop_fired_events");
+	return pos;
+}
+
+void EventLoop::dispatch(int fd, int mask){
+	FileEventVector_t& events = this->poll->getFileEvents();
+	FileEvent *fe = &events[fd];
+	int rfired = 0;
+
+	if (mask & AE_ERRQUEUE) {
+		mask &= ~AE_ERRQUEUE;
+		if (fe->mask & AE_ERRQUEUE) {
+			mask |= AE_READABLE|AE_ERRQUEUE;
+		}
+	}
+	if (this->budget.us) {
+		this->handlerStart = monotonicTime();
+	}
+	/* note the fe->mask & mask & ... code: maybe an already processed
+	* event removed an element that fired and we still didn't
+	* processed, so we check if the event is still valid. */
+	if (fe->mask & mask & AE_READABLE) {
+		rfired = 1;
+		fe->rfileProc(this,fd,fe->clientData,mask);
+		/* The handler may have grown the table */
+		fe = &events[fd];
+	}
+	if (fe->mask & mask & AE_WRITABLE) {
+		if (!rfired || fe->wfileProc != fe->rfileProc){
+			fe->wfileProc(this,fd,fe->clientData,mask);
+		}
+	}
+}
+
+/* For the running file handler: did it do enough for this call, having
+* read 'bytes' and executed 'commands'? */
+int EventLoop::overBudget(size_t bytes, long commands) const{
+	if (this->budget.bytes && bytes >= this->budget.bytes) {
+		return 1;
+	}
+	if (this->budget.commands && commands >= this->budget.commands) {
+		return 1;
+	}
+	if (this->budget.us && monotonicTime() - this->handlerStart >= this->budget.us) {
+		return 1;
+	}
+	return 0;
+}
+
+/* Called by a file handler that stops before it is done with 'fd', out
+* of budget: the 'mask' events are run again at the start of the next
+* iteration, whether or not the poll reports them, which also keeps an
+* AE_EDGE fd going. */
+void EventLoop::yield(int fd, int mask){
+	FileEventVector_t& events = this->poll->getFileEvents();
+	if (fd < 0 || fd >= static_cast<int>(events.size())) {
+		return;
+	}
+	FileEvent& fe = events[fd];
+	mask &= fe.mask & AE_IO_EVENTS & ~fe.yielded;
+	if (mask == AE_NONE) {
+		return;
+	}
+	if (fe.yielded != AE_NONE) {
+		/* Already queued: widen the entry */
+		for (size_t i = 0; i < this->carryOver.size(); ++ i) {
+			if (this->carryOver[i].fd == fd) {
+				this->carryOver[i].mask |= mask;
+				break;
+			}
+		}
+	} else {
+		this->carryOver.push_back(FiredEvent(fd,mask));
+	}
+	fe.yielded |= mask;
+	this->loopStats.yields ++;
+}
+
 void EventLoop::stop(){
 	this->stop_flag = 1;
 }
 
-int EventLoop::createFileEvent(FileEvent* event,int fd){
-	FileEventVector_t& events = this->poll->getFileEvents();
-	if (fd >= static_cast<int>(events.size())) {
-		errno = ERANGE;
+int EventLoop::getSetSize() const{
+	return static_cast<int>(this->poll->getFileEvents().size());
+}
+
+/* Resize the fd table, which bounds the fds the loop can watch: 'setsize'
+* must be above every fd still registered. The poll batch is not tied to
+* it, so growing the table to millions of fds costs a few bytes per fd and
+* nothing per poll. Returns AE_ERR with errno set on failure. */
+int EventLoop::resizeSetSize(int setsize){
+	int cursize = this->getSetSize();
+	if (setsize == cursize) {
+		return AE_OK;
+	}
+	if (setsize < 1) {
+		errno = EINVAL;
 		return AE_ERR;
 	}
-	//events[fd]==NULL is ok
-	delete events[fd];
-	events[fd] = event;
+	if (setsize <= this->maxfd) {
+		/* maxfd is a high-water mark: look for the real highest fd */
+		FileEventVector_t& events = this->poll->getFileEvents();
+		int fd = this->maxfd;
+		while (fd >= 0 && events[fd].mask == AE_NONE) {
+			fd --;
+		}
+		if (fd >= setsize) {
+			errno = EBUSY;
+			return AE_ERR;
+		}
+		this->maxfd = fd;
+	}
+	if (this->poll->resize(setsize) == -1) {
+		return AE_ERR;
+	}
+	/* Forget the yielded fds that just fell off the table */
+	for (size_t i = 0; i < this->carryOver.size(); ) {
+		if (this->carryOver[i].fd >= setsize) {
+			this->carryOver.erase(this->carryOver.begin() + i);
+		} else {
+			++ i;
+		}
+	}
+	return AE_OK;
+}
 
-	if (this->poll->addEvent(fd, event->mask) == -1){
+int EventLoop::createFileEvent(int fd, int mask, FileProc_t* proc, void* clientData){
+	if (fd < 0) {
+		errno = EBADF;
 		return AE_ERR;
 	}
+	int setsize = this->getSetSize();
+	if (fd >= setsize) {
+		/* Double the table, so that a stream of accept() returning ever
+		* larger fds only grows it a logarithmic number of times */
+		int grown = setsize*2 > fd ? setsize*2 : fd+1;
+		if (this->setsizeLimit > 0 && grown > this->setsizeLimit) {
+			grown = this->setsizeLimit;
+		}
+		if (fd >= grown) {
+			errno = ERANGE;
+			return AE_ERR;
+		}
+		if (this->resizeSetSize(grown) == AE_ERR) {
+			return AE_ERR;
+		}
+	}
+	FileEventVector_t& events = this->poll->getFileEvents();
+	if (this->poll->addEvent(fd, mask) == -1){
+		return AE_ERR;
+	}
+	FileEvent& fe = events[fd];
+	if (!(fe.mask & AE_IO_EVENTS) && (mask & AE_IO_EVENTS)) {
+		this->numfds ++;
+	}
+	fe.mask |= mask;
+	if (mask & AE_READABLE) fe.rfileProc = proc;
+	if (mask & AE_WRITABLE) fe.wfileProc = proc;
+	fe.clientData = clientData;
 	if (fd > this->maxfd){
 		this->maxfd = fd;
 	}
 	return AE_OK;
 }
 
+/* maxfd is a high-water mark: it is not lowered when the highest fd goes
+* away, which would mean scanning the table, but reset once no fd is left.
+* Only the select() layer looks at it, and a stale bound just costs it a
+* few more bits to test. */
 void EventLoop::deleteFileEvent(int fd, int mask){
 	FileEventVector_t& events = this->poll->getFileEvents();
-	if (fd >= static_cast<int>(events.size())) {
+	if (fd < 0 || fd >= static_cast<int>(events.size())) {
 		return ;
 	}
-	FileEvent *fe = events[fd];
-	if (fe->mask != AE_NONE) {
-		fe->mask = fe->mask & (~mask);
-		if (fd == this->maxfd && fe->mask == AE_NONE) {
-			/* Update the max fd */
-			int j = this->maxfd - 1;
-			for (; j >= 0; -- j){
-				if (events[j]->mask != AE_NONE) {
-					break;
-				}
-			}
-			this->maxfd = j;
-		}
-		this->poll->delEvent(fd, mask);
+	FileEvent& fe = events[fd];
+	if (fe.mask == AE_NONE) {
+		return;
 	}
-
-	if (fe->mask == AE_NONE){
-		delete fe;
-		events[fd] = NULL;
+	/* The mask is updated first: the event ports layer reads the events
+	* left from it */
+	int counted = fe.mask & AE_IO_EVENTS;
+	fe.mask = fe.mask & (~mask);
+	if (!(fe.mask & AE_IO_EVENTS)) {
+		fe.mask = AE_NONE;
+	}
+	this->poll->delEvent(fd, mask);
+	if (fe.mask == AE_NONE) {
+		/* 'yielded' stays: the carry-over may still hold the fd */
+		fe.rfileProc = fe.wfileProc = NULL;
+		fe.clientData = NULL;
+		if (counted && -- this->numfds == 0) {
+			this->maxfd = -1;
+		}
 	}
 }
 
 int EventLoop::getFileEvents(int fd){
 	FileEventVector_t& events = this->poll->getFileEvents();
-	if (fd >= static_cast<int>(events.size())) {
+	if (fd < 0 || fd >= static_cast<int>(events.size())) {
 		return 0;
 	}
-	FileEvent *fe = events[fd];
-	return fe->mask;
+	return events[fd].mask;
 }
 
 long EventLoop::createTimeEvent(TimeEvent* te,long milliseconds){
+	return this->createTimeEventUs(te,static_cast<long long>(milliseconds)*1000);
+}
+
+long EventLoop::createTimeEventUs(TimeEvent* te,long long microseconds){
 	long id = this->timeEventNextId ++;
 	te->id = id;
-	addMillisecondsToNow(milliseconds,&te->when_sec,&te->when_ms);
-	this->timers.push_back(te);
+	te->when = this->timerBase() + microseconds;
+	this->timerIds[id] = te;
+	this->timerPush(te);
 	return id;
 }
 
 int EventLoop::deleteTimeEvent(long id){
-	for (TimeEventVector_t::iterator itr = this->timers.begin(), end = this->timers.end();
-		itr != end; ++ itr)
-	{
-		TimeEvent* te = *itr;
-		if (te->id == id){
-			te->onFinalizer(this);
-			delete te;
-			this->timers.erase(itr);
-			return AE_OK;
-		}
+	TimeEventMap_t::iterator itr = this->timerIds.find(id);
+	if (itr == this->timerIds.end()){
+		return AE_ERR;
 	}
-	return AE_ERR;
+	TimeEvent* te = itr->second;
+	this->timerIds.erase(itr);
+	if (te->index != AE_TIMER_DETACHED){
+		this->timerRemove(te);
+	}
+	te->onFinalizer(this);
+	delete te;
+	return AE_OK;
+}
+
+int EventLoop::rescheduleTimeEvent(long id,long milliseconds){
+	return this->rescheduleTimeEventUs(id,static_cast<long long>(milliseconds)*1000);
+}
+
+int EventLoop::rescheduleTimeEventUs(long id,long long microseconds){
+	TimeEventMap_t::iterator itr = this->timerIds.find(id);
+	if (itr == this->timerIds.end()){
+		return AE_ERR;
+	}
+	TimeEvent* te = itr->second;
+	te->when = this->timerBase() + microseconds;
+	if (te->index == AE_TIMER_DETACHED){
+		/* Rescheduled from a timer handler while detached: queue it again */
+		this->timerPush(te);
+	} else {
+		size_t pos = te->index;
+		this->timerSiftUp(pos);
+		this->timerSiftDown(te->index);
+	}
+	return AE_OK;
 }
 
 int EventLoop::processEvents(int flags){
@@ -184,7 +652,15 @@ int EventLoop::processEvents(int flags){
 		return 0;
 	}
 
+	if (flags & AE_CALL_BEFORE_SLEEP) {
+		if (NULL != this->beforeSleepProc){
+			this->beforeSleepProc(this);
+		}
+		this->runSleepHooks(AE_BEFORE_SLEEP);
+	}
+
 	int processed = 0;
+	int processing = this->processing;
 	/* Note that we want call select() even if there are no
 	* file events to process as long as we want to process time
 	* events, in order to sleep until the next time event is ready
@@ -199,21 +675,15 @@ int EventLoop::processEvents(int flags){
 		if (flags & AE_TIME_EVENTS && !(flags & AE_DONT_WAIT))
 			shortest = this->searchNearestTimer();
 		if (shortest) {
-			long now_sec, now_ms;
-
 			/* Calculate the time missing for the nearest
-			* timer to fire. */
-			getTime(&now_sec, &now_ms);
+			* timer to fire. The cached time is as old as the
+			* handlers that ran since the last poll, so read the
+			* clock again here. */
+			long long us = shortest->when - this->updateTime();
+			if (us < 0) us = 0;
 			tvp = &tv;
-			tvp->tv_sec = shortest->when_sec - now_sec;
-			if (shortest->when_ms < now_ms) {
-				tvp->tv_usec = ((shortest->when_ms+1000) - now_ms)*1000;
-				tvp->tv_sec --;
-			} else {
-				tvp->tv_usec = (shortest->when_ms - now_ms)*1000;
-			}
-			if (tvp->tv_sec < 0) tvp->tv_sec = 0;
-			if (tvp->tv_usec < 0) tvp->tv_usec = 0;
+			tvp->tv_sec = us / 1000000;
+			tvp->tv_usec = us % 1000000;
 		} else {
 			/* If we have to check for events but need to return
 			* ASAP because of AE_DONT_WAIT we need to set the timeout
@@ -226,35 +696,76 @@ int EventLoop::processEvents(int flags){
 				tvp = NULL; /* wait forever */
 			}
 		}
+		if (this->taskBacklog || this->hookBacklog || !this->carryOver.empty()) {
+			/* Posted tasks, yielded handlers or hooks are left over from
+			* the last iteration */
+			tv.tv_sec = tv.tv_usec = 0;
+			tvp = &tv;
+		}
 
 		FileEventVector_t& events = this->poll->getFileEvents();
 		FiredEventVector_t& fired = this->poll->getFiredEvents();
+		long long start = this->latencyTracking ? monotonicTime() : 0;
 		int numevents = this->poll->poll(tvp,this->maxfd);
+		this->updateTime();
+		this->processing = 1;
+		if (this->latencyTracking) {
+			this->loopStats.pollWait.add(this->now_us - start);
+			this->loopStats.fired.add(numevents);
+		}
+		if (flags & AE_CALL_AFTER_SLEEP) {
+			this->runSleepHooks(AE_AFTER_SLEEP);
+		}
+		/* The after sleep hooks are accounted for on their own */
+		long long dispatchStart = this->latencyTracking ? monotonicTime() : 0;
+
+		/* The handlers that yielded last time go first, then the new
+		* events, minus those the carry-over already covered: a client
+		* out of budget gets one turn per iteration like everybody else. */
+		FiredEventVector_t& resuming = this->resuming;
+		resuming.swap(this->carryOver);
+		for (size_t j = 0; j < resuming.size(); ++ j) {
+			events[resuming[j].fd].yielded = AE_NONE;
+		}
+		for (size_t j = 0; j < resuming.size(); ++ j) {
+			int fd = resuming[j].fd;
+			events[fd].resumed |= resuming[j].mask;
+			this->dispatch(fd,resuming[j].mask);
+			this->loopStats.resumed ++;
+			processed ++;
+		}
 		for (int j = 0; j < numevents; j ++) {
-			FileEvent *fe = events[fired[j].fd];
-			int mask = fired[j].mask;
 			int fd = fired[j].fd;
-			int rfired = 0;
-
-			/* note the fe->mask & mask & ... code: maybe an already processed
-			* event removed an element that fired and we still didn't
-			* processed, so we check if the event is still valid. */
-			if (fe->mask & mask & AE_READABLE) {
-				rfired = 1;
-				fe->onRead(this,fd,mask);
-			}
-			if (fe->mask & mask & AE_WRITABLE) {
-				if (!rfired || !fe->isSameForIO()){
-					fe->OnWrite(this,fd,mask);
-				}
+			int mask = fired[j].mask & ~events[fd].resumed;
+			if (mask != AE_NONE) {
+				this->dispatch(fd,mask);
+				processed ++;
 			}
-			processed ++;
 		}
+		for (size_t j = 0; j < resuming.size(); ++ j) {
+			events[resuming[j].fd].resumed = AE_NONE;
+		}
+		resuming.clear();
+		if (this->latencyTracking) {
+			this->loopStats.fileTime.add(monotonicTime() - dispatchStart);
+		}
+	} else {
+		this->updateTime();
+		this->processing = 1;
 	}
+	processed += this->processTasks();
 	/* Check time events */
 	if (flags & AE_TIME_EVENTS){
-		processed += this->processTimeEvents();
+		if (this->latencyTracking) {
+			long long start = monotonicTime();
+			processed += this->processTimeEvents();
+			this->loopStats.timerTime.add(monotonicTime() - start);
+		} else {
+			processed += this->processTimeEvents();
+		}
 	}
+	this->loopStats.iterations ++;
+	this->processing = processing;
 
 	return processed; /* return the number of processed file/time events */
 }
@@ -281,90 +792,263 @@ int EventLoop::wait(int fd,int mask,long milliseconds){
 
 void EventLoop::main(){
 	this->stop_flag = 0;
+	this->thread = pthread_self();
+	this->threadBound = 1;
 	while (!this->stop_flag) {
-		if (NULL != this->beforeSleepProc){
-			this->beforeSleepProc(this);
+		int flags = AE_ALL_EVENTS|AE_CALL_BEFORE_SLEEP|AE_CALL_AFTER_SLEEP;
+		if (this->busyPollUs) {
+			if (this->busyPoll()) {
+				continue;
+			}
+			/* Nothing ran since the before sleep hooks of the first spin */
+			flags &= ~AE_CALL_BEFORE_SLEEP;
 		}
-		this->processEvents(AE_ALL_EVENTS);
+		this->loopStats.blocks ++;
+		this->processEvents(flags);
 	}
 }
-//////////////////////////////////////////////////////////////////////////
-TimeEvent* EventLoop::searchNearestTimer(){
-	TimeEvent* nearest = NULL;
-	if (!this->timers.empty()){
-		TimeEventVector_t::iterator itr = this->timers.begin();
-		nearest = *itr;
-		++ itr;
-		for (TimeEventVector_t::iterator end = this->timers.end();itr != end; ++ itr){
-			TimeEvent* te = *itr;
-			if (te->when_sec < nearest->when_sec ||
-				(te->when_sec == nearest->when_sec &&te->when_ms < nearest->when_ms))
-			{
-				nearest = te;
+
+/* Poll without blocking until something happens or the busy poll budget
+* is spent. Returns 1 if events were processed: the caller comes back
+* here with a fresh budget. The before sleep hooks run ahead of the first
+* spin only: while nothing happens no handler runs, so there is nothing
+* new for them between two spins. */
+int EventLoop::busyPoll(){
+	long long deadline = this->updateTime() + this->busyPollUs;
+	int flags = AE_ALL_EVENTS|AE_DONT_WAIT|AE_CALL_BEFORE_SLEEP|AE_CALL_AFTER_SLEEP;
+	while (!this->stop_flag) {
+		this->loopStats.spins ++;
+		if (this->processEvents(flags) > 0) {
+			this->loopStats.spinHits ++;
+			return 1;
+		}
+		flags &= ~AE_CALL_BEFORE_SLEEP;
+		if (this->now_us >= deadline) {
+			break;
+		}
+	}
+	return 0;
+}
+
+/* Register a hook to run at every iteration of main(), right before the
+* poll (AE_BEFORE_SLEEP) or right after it returns (AE_AFTER_SLEEP). The
+* hooks of a phase run by increasing 'order', then by registration. With a
+* 'budgetUs' the hook is told when to stop: it is up to the hook to yield
+* on time, the loop only counts the overruns. The after sleep hooks also
+* run after every spin of the busy poll, so they must be cheap when there
+* is nothing to do. Returns the hook id, or AE_ERR. */
+long EventLoop::addSleepHook(int when, int order, SleepHookProc_t* proc,
+	void* clientData, long long budgetUs)
+{
+	if ((when != AE_BEFORE_SLEEP && when != AE_AFTER_SLEEP) || proc == NULL) {
+		return AE_ERR;
+	}
+	SleepHook hook;
+	hook.id = this->hookNextId ++;
+	hook.when = when;
+	hook.order = order;
+	hook.budgetUs = budgetUs > 0 ? budgetUs : 0;
+	hook.proc = proc;
+	hook.clientData = clientData;
+	if (this->hookDepth) {
+		/* Added by a running hook: it joins from the next pass */
+		this->hookAdds.push_back(hook);
+	} else {
+		this->insertSleepHook(hook);
+	}
+	return hook.id;
+}
+
+void EventLoop::insertSleepHook(const SleepHook& hook){
+	SleepHookVector_t& hooks = this->hooks[hook.when];
+	size_t pos = hooks.size();
+	while (pos > 0 && hooks[pos-1].order > hook.order) {
+		pos --;
+	}
+	hooks.insert(hooks.begin() + pos, hook);
+}
+
+int EventLoop::removeSleepHook(long id){
+	for (size_t i = 0; i < this->hookAdds.size(); ++ i) {
+		if (this->hookAdds[i].id == id) {
+			this->hookAdds.erase(this->hookAdds.begin() + i);
+			return AE_OK;
+		}
+	}
+	for (int when = AE_BEFORE_SLEEP; when <= AE_AFTER_SLEEP; ++ when) {
+		SleepHookVector_t& hooks = this->hooks[when];
+		for (size_t i = 0; i < hooks.size(); ++ i) {
+			if (hooks[i].id != id || hooks[i].proc == NULL) {
+				continue;
 			}
+			if (this->hookDepth) {
+				/* A hook is running: drop the entry after the pass */
+				hooks[i].proc = NULL;
+			} else {
+				hooks.erase(hooks.begin() + i);
+			}
+			return AE_OK;
 		}
 	}
-	return nearest;
+	return AE_ERR;
+}
+
+void EventLoop::runSleepHooks(int when){
+	SleepHookVector_t& hooks = this->hooks[when];
+	this->hookBacklog &= ~(1 << when);
+	if (hooks.empty()) {
+		return;
+	}
+	/* The lists don't move while the hooks run: additions are queued and
+	* removals only clear the entry, both applied after the pass. */
+	this->hookDepth ++;
+	for (size_t i = 0; i < hooks.size(); ++ i) {
+		const SleepHook& hook = hooks[i];
+		if (hook.proc == NULL) {
+			continue;
+		}
+		long long deadline = 0;
+		if (hook.budgetUs) {
+			deadline = monotonicTime() + hook.budgetUs;
+		}
+		if (hook.proc(this,hook.clientData,deadline)) {
+			this->hookBacklog |= 1 << when;
+		}
+		this->loopStats.hookRuns ++;
+		if (deadline && monotonicTime() > deadline) {
+			this->loopStats.hookOverruns ++;
+		}
+	}
+	if (-- this->hookDepth == 0) {
+		for (int phase = AE_BEFORE_SLEEP; phase <= AE_AFTER_SLEEP; ++ phase) {
+			SleepHookVector_t& list = this->hooks[phase];
+			for (size_t i = 0; i < list.size(); ) {
+				if (list[i].proc == NULL) {
+					list.erase(list.begin() + i);
+				} else {
+					++ i;
+				}
+			}
+		}
+		for (size_t i = 0; i < this->hookAdds.size(); ++ i) {
+			this->insertSleepHook(this->hookAdds[i]);
+		}
+		this->hookAdds.clear();
+	}
+}
+//////////////////////////////////////////////////////////////////////////
+/* The timers are kept in a binary min-heap ordered by deadline. Every timer
+* remembers its slot in the heap, so the nearest deadline is O(1) and
+* insert, cancel and reschedule are O(log n). */
+void EventLoop::timerSiftUp(size_t pos){
+	TimeEventVector_t& heap = this->timers;
+	TimeEvent* te = heap[pos];
+	while (pos > 0) {
+		size_t parent = (pos - 1) / 2;
+		if (!timerBefore(te,heap[parent])){
+			break;
+		}
+		heap[pos] = heap[parent];
+		heap[pos]->index = pos;
+		pos = parent;
+	}
+	heap[pos] = te;
+	te->index = pos;
+}
+
+void EventLoop::timerSiftDown(size_t pos){
+	TimeEventVector_t& heap = this->timers;
+	size_t size = heap.size();
+	TimeEvent* te = heap[pos];
+	for (;;) {
+		size_t child = 2 * pos + 1;
+		if (child >= size){
+			break;
+		}
+		if (child + 1 < size && timerBefore(heap[child + 1],heap[child])){
+			child ++;
+		}
+		if (!timerBefore(heap[child],te)){
+			break;
+		}
+		heap[pos] = heap[child];
+		heap[pos]->index = pos;
+		pos = child;
+	}
+	heap[pos] = te;
+	te->index = pos;
+}
+
+void EventLoop::timerPush(TimeEvent* te){
+	te->index = this->timers.size();
+	this->timers.push_back(te);
+	this->timerSiftUp(te->index);
+}
+
+void EventLoop::timerRemove(TimeEvent* te){
+	TimeEventVector_t& heap = this->timers;
+	size_t pos = te->index;
+	TimeEvent* last = heap.back();
+	heap.pop_back();
+	te->index = AE_TIMER_DETACHED;
+	if (last != te) {
+		heap[pos] = last;
+		last->index = pos;
+		this->timerSiftUp(pos);
+		this->timerSiftDown(last->index);
+	}
+}
+
+TimeEvent* EventLoop::searchNearestTimer(){
+	return this->timers.empty() ? NULL : this->timers[0];
 }
 
 int EventLoop::processTimeEvents(){
-	time_t now = time(NULL);
-	/* If the system clock is moved to the future, and then set back to the
-	* right value, time events may be delayed in a random way. Often this
-	* means that scheduled operations will not be performed soon enough.
+	TimeEventVector_t& heap = this->timers;
+
+	/* Detach every timer that is already due before running any handler.
+	* Handlers may create, delete or reschedule timers: working on this
+	* snapshot makes sure that a timer created or rescheduled to fire "now"
+	* waits for the next iteration instead of looping forever.
 	*
-	* Here we try to detect system clock skews, and force all the time
-	* events to be processed ASAP when this happens: the idea is that
-	* processing events earlier is less dangerous than delaying them
-	* indefinitely, and practice suggests it is. */
-	if (now < this->lastTime) {
-		for (TimeEventVector_t::iterator itr = this->timers.begin(), end = this->timers.end();
-			itr != end; ++ itr)
-		{
-			(*itr)->when_sec = 0;
+	* Deadlines are on the monotonic clock, so stepping the system clock
+	* can't make the timers fire early, late or all at once. */
+	std::vector<long>& due = this->dueTimers;
+	due.clear();
+	while (!heap.empty()) {
+		TimeEvent* te = heap[0];
+		if (te->when > this->now_us){
+			break;
 		}
+		due.push_back(te->id);
+		this->timerRemove(te);
 	}
-	this->lastTime = now;
 
 	int processed = 0;
-	long maxId = this->timeEventNextId-1;
-	for (TimeEventVector_t::iterator itr = this->timers.begin(), end = this->timers.end();
-		itr != end; ++ itr)
-	{
-		TimeEvent* te = *itr;
-		if (te->id > maxId) {
+	for (size_t i = 0; i < due.size(); ++ i) {
+		long id = due[i];
+		TimeEventMap_t::iterator itr = this->timerIds.find(id);
+		/* Deleted or rescheduled by a handler that ran before this one */
+		if (itr == this->timerIds.end() || itr->second->index != AE_TIMER_DETACHED){
 			continue;
 		}
+		TimeEvent* te = itr->second;
+		if (this->latencyTracking) {
+			this->loopStats.timerLag.add(this->now_us - te->when);
+		}
+		int retval = te->onTimer(this, id);
+		processed++;
 
-		long now_sec = 0;
-		long now_ms = 0;
-		getTime(&now_sec, &now_ms);
-		if (now_sec > te->when_sec ||
-			(now_sec == te->when_sec && now_ms >= te->when_ms))
-		{
-			long id = te->id;
-			int retval = te->onTimer(this, id);
-			processed++;
-			/* After an event is processed our time event list may
-			* no longer be the same, so we restart from head.
-			* Still we make sure to don't process events registered
-			* by event handlers itself in order to don't loop forever.
-			* To do so we saved the max ID we want to handle.
-			*
-			* FUTURE OPTIMIZATIONS:
-			* Note that this is NOT great algorithmically. Redis uses
-			* a single time event so it's not a problem but the right
-			* way to do this is to add the new elements on head, and
-			* to flag deleted elements in a special way for later
-			* deletion (putting references to the nodes to delete into
-			* another linked list). */
-			if (retval != AE_NOMORE) {
-				addMillisecondsToNow(retval,&te->when_sec,&te->when_ms);
-			} else {
-				this->deleteTimeEvent(id);
-				end = this->timers.end();
-			}
-			itr = this->timers.begin();
+		/* The handler may have deleted or rescheduled its own timer */
+		itr = this->timerIds.find(id);
+		if (itr == this->timerIds.end()){
+			continue;
+		}
+		if (retval == AE_NOMORE) {
+			this->deleteTimeEvent(id);
+		} else if (te->index == AE_TIMER_DETACHED) {
+			te->when = this->now_us + static_cast<long long>(retval)*1000;
+			this->timerPush(te);
 		}
 	}
 	return processed;
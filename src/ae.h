@@ -5,7 +5,10 @@
 #define _REDIS_REDISCPP_AE_H_
 
 #include <vector>
+#include <map>
+#include <stddef.h>
 #include <sys/time.h>
+#include <pthread.h>
 
 namespace redis{
 
@@ -16,13 +19,57 @@ namespace redis{
 		AE_NONE = 0,
 		AE_READABLE = 1,
 		AE_WRITABLE = 2,
+		AE_IO_EVENTS = (AE_READABLE|AE_WRITABLE),
+
+		/* Registration flags, passed to createFileEvent() with the events.
+		* They stick to the fd until its last event is deleted, and are
+		* honoured by the epoll layer only (AE_ERRQUEUE by io_uring as
+		* well), ignored elsewhere.
+		*
+		* AE_EDGE reports readiness changes only (EPOLLET): the loop is not
+		* woken up again for data left in the socket, so the handler must
+		* read, or write, until the call fails with EAGAIN. Stopping earlier
+		* is fine only if the handler comes back to it on its own, with
+		* EventLoop::yield() for instance. In
+		* exchange a busy pipelined client costs one event per burst
+		* instead of one per iteration.
+		*
+		* AE_EXCLUSIVE wakes up a single one of the loops waiting on the
+		* same fd (EPOLLEXCLUSIVE), for a listener shared between loops.
+		*
+		* AE_ERRQUEUE has the AE_READABLE handler called, with AE_ERRQUEUE in
+		* its mask, when the socket error queue has messages: MSG_ZEROCOPY
+		* completions, see ReplyChain::reapZeroCopy(). Without it they wake
+		* up the AE_WRITABLE handler, if any, like any socket error. */
+		AE_EDGE = 4,
+		AE_EXCLUSIVE = 8,
+		AE_ERRQUEUE = 16,
 
 		AE_FILE_EVENTS = 1,
 		AE_TIME_EVENTS = 2,
 		AE_ALL_EVENTS = (AE_FILE_EVENTS|AE_TIME_EVENTS),
 		AE_DONT_WAIT = 4,
+		AE_CALL_BEFORE_SLEEP = 8,
+		AE_CALL_AFTER_SLEEP = 16,
+
+		/* When a sleep hook runs, see EventLoop::addSleepHook() */
+		AE_BEFORE_SLEEP = 0,
+		AE_AFTER_SLEEP = 1,
+
+		AE_NOMORE = -1,
+
+		/* Posted tasks run per iteration, the rest waits for the next one */
+		AE_MAX_TASKS_PER_ITERATION = 1024,
+
+		AE_HIST_BUCKETS = 40,
+
+		/* Events returned by one poll at most, whatever the set size */
+		AE_POLL_BATCH = 1024,
 
-		AE_NOMORE = -1
+		/* Multiplexing layer to ask EventLoop::init() for. Unless the layer
+		* is compiled in and usable at runtime, the default one is used. */
+		AE_API_DEFAULT = 0,
+		AE_API_URING = 1
 	};
 
 	struct FiredEvent{
@@ -35,31 +82,120 @@ namespace redis{
 
 	typedef std::vector<FiredEvent> FiredEventVector_t;
 
+	/* Registration syscalls of the multiplexing layer. Layers that batch
+	* or collapse interest changes make fewer syscalls than changes. */
+	struct PollStats{
+		long long changes;  /* interest mask changes asked for */
+		long long syscalls; /* registration syscalls actually made */
+		PollStats()
+			:changes(0),syscalls(0)
+		{}
+		long long saved() const{
+			return this->changes - this->syscalls;
+		}
+	};
+
+	/* Log2-bucketed histogram: bucket 0 counts the samples <= 0 and bucket
+	* i the samples in [2^(i-1), 2^i). Adding a sample is a couple of
+	* instructions, and percentiles are reported as the upper bound of the
+	* bucket they fall in, so they are exact within a factor of two. */
+	struct LatencyHistogram{
+		long long buckets[AE_HIST_BUCKETS];
+		long long count;
+		long long sum;
+		long long max;
+		LatencyHistogram(){
+			this->reset();
+		}
+		void add(long long value){
+			int bucket = 0;
+			if (value > 0) {
+				bucket = 64 - __builtin_clzll(static_cast<unsigned long long>(value));
+				if (bucket >= AE_HIST_BUCKETS) bucket = AE_HIST_BUCKETS - 1;
+				this->sum += value;
+				if (value > this->max) this->max = value;
+			}
+			this->buckets[bucket] ++;
+			this->count ++;
+		}
+		void reset();
+		long long percentile(double p) const;
+		long long mean() const{
+			return this->count ? this->sum / this->count : 0;
+		}
+		size_t catInfo(char* buf, size_t len, size_t pos, const char* name) const;
+	};
+
+	/* Where the time of the event loop goes, per iteration. Durations are
+	* in microseconds. */
+	struct LoopStats{
+		long long iterations;
+		long long spins;    /* non blocking polls made while busy polling */
+		long long spinHits; /* of which found something to do */
+		long long blocks;   /* polls allowed to block */
+		long long yields;   /* handlers that ran out of budget and yielded */
+		long long resumed;  /* yielded events run again the next iteration */
+		long long hookRuns;
+		long long hookOverruns; /* hooks that went past their time budget */
+		LatencyHistogram pollWait;  /* blocked in the multiplexing layer */
+		LatencyHistogram fileTime;  /* running the file event handlers */
+		LatencyHistogram timerTime; /* running the timers */
+		LatencyHistogram fired;     /* file events returned by the poll */
+		LatencyHistogram timerLag;  /* how late each timer ran, per timer */
+		LoopStats()
+			:iterations(0),spins(0),spinHits(0),blocks(0),yields(0),resumed(0),
+			hookRuns(0),hookOverruns(0)
+		{}
+		void reset();
+	};
+
+	/* TimeEvent::index of a timer that is not queued in the heap */
+	const size_t AE_TIMER_DETACHED = static_cast<size_t>(-1);
 
 	class EventLoop;
 
-	class FileEvent{
-	public:
-		int mask;
+	typedef void FileProc_t(EventLoop* eventLoop, int fd, void* clientData, int mask);
+
+	/* Handler record of a registered fd. The records are stored by value,
+	* indexed by fd, so registering and dispatching never allocate and the
+	* dispatch is a plain indirect call. */
+	struct FileEvent{
+		int mask; /* AE_(READABLE|WRITABLE), plus the registration flags */
+		short yielded; /* events queued by yield() for the next iteration */
+		short resumed; /* events run from the carry-over this iteration */
+		FileProc_t* rfileProc;
+		FileProc_t* wfileProc;
+		void* clientData;
 		FileEvent()
-			:mask(AE_NONE)
+			:mask(AE_NONE),yielded(AE_NONE),resumed(AE_NONE),
+			rfileProc(NULL),wfileProc(NULL),clientData(NULL)
 		{}
-		virtual ~FileEvent(){}
-		virtual void onRead(EventLoop* eventLoop, int fd, int mask){}
-		virtual void OnWrite(EventLoop* eventLoop, int fd, int mask){}
-		virtual bool isSameForIO() const { return false;}
 	};
 
-	typedef std::vector<FileEvent*> FileEventVector_t;
+	/* How much a file handler should do per call before it yields, so that
+	* a client with a deep pipeline can't hold an iteration for itself.
+	* The loop can't tell bytes or commands apart, the handlers count them
+	* and ask EventLoop::overBudget(). 0 means no limit. */
+	struct HandlerBudget{
+		size_t bytes;
+		long commands;
+		long long us;
+		HandlerBudget()
+			:bytes(0),commands(0),us(0)
+		{}
+	};
+
+	typedef std::vector<FileEvent> FileEventVector_t;
 
 	class TimeEvent{
 	public:
 		long id;
-		long when_sec;
-		long when_ms;
+		long long when; /* monotonic deadline, in microseconds */
+		size_t index; /* slot in the timer heap, AE_TIMER_DETACHED if none */
 		TimeEvent()
-			:id(0),when_sec(0),when_ms(0)
+			:id(0),when(0),index(AE_TIMER_DETACHED)
 		{}
+		virtual ~TimeEvent(){}
 		virtual int onTimer(EventLoop* eventLoop, long id){
 			return 0;
 		}
@@ -67,41 +203,171 @@ namespace redis{
 	};
 
 	typedef std::vector<TimeEvent*> TimeEventVector_t;
+	typedef std::map<long,TimeEvent*> TimeEventMap_t;
+
+	/* Work handed to an event loop with EventLoop::post(). The task is run
+	* on the loop thread and deleted by the loop right after. */
+	class LoopTask{
+	public:
+		LoopTask* next; /* link in the posting queue */
+		LoopTask()
+			:next(NULL)
+		{}
+		virtual ~LoopTask(){}
+		virtual void run(EventLoop* eventLoop){}
+	};
 
 	typedef void BeforeSleepProc_t(EventLoop*);
 
+	/* A sleep hook gets the monotonic time, in microseconds, it should be
+	* done by, or 0 when it has no budget. It returns non zero if it stopped
+	* with work left: the next poll then doesn't block, so that the hook
+	* runs again right away. */
+	typedef int SleepHookProc_t(EventLoop* eventLoop, void* clientData, long long deadline);
+
+	struct SleepHook{
+		long id;
+		int when;
+		int order;
+		long long budgetUs;
+		SleepHookProc_t* proc; /* NULL once removed */
+		void* clientData;
+	};
+
+	typedef std::vector<SleepHook> SleepHookVector_t;
+
 	struct PollCtrl;
+	struct TaskQueue;
 
 	class EventLoop{
-		int maxfd;
+		int maxfd;   /* highest fd registered since the table was last empty */
+		int numfds;  /* number of fds with a non empty mask */
+		int setsizeLimit; /* createFileEvent() grows the table up to this */
 		int stop_flag;
 		long timeEventNextId;
-		time_t lastTime;
+		int coarseClock;
+		long long now_us; /* monotonic time cached once per iteration */
+		int processing;   /* between the poll and the end of the iteration */
 		PollCtrl* poll;
-		TimeEventVector_t timers;
+		TimeEventVector_t timers; /* binary min-heap ordered by deadline */
+		TimeEventMap_t timerIds;  /* id -> timer, for cancel and reschedule */
+		std::vector<long> dueTimers;
 		BeforeSleepProc_t* beforeSleepProc;
+		TaskQueue* tasks;
+		int wakeupfd[2]; /* eventfd in both slots, or a pipe */
+		int wakeupPending; /* a wakeup was written and not consumed yet */
+		int taskBacklog;
+		pthread_t thread;
+		int threadBound;
+		int latencyTracking;
+		long long busyPollUs;
+		HandlerBudget budget;
+		long long handlerStart; /* when the running file handler was called */
+		FiredEventVector_t carryOver; /* yielded, to run next iteration */
+		FiredEventVector_t resuming;  /* the carry-over being run */
+		SleepHookVector_t hooks[2];   /* by phase, sorted by order */
+		long hookNextId;
+		int hookBacklog; /* bit per phase: a hook has work left */
+		int hookDepth;   /* hooks running: changes to the lists are deferred */
+		SleepHookVector_t hookAdds;
+		LoopStats loopStats;
 
 		TimeEvent* searchNearestTimer();
 		int processTimeEvents();
+		int processTasks();
+		int busyPoll();
+		void dispatch(int fd, int mask);
+		void runSleepHooks(int when);
+		void insertSleepHook(const SleepHook& hook);
+		int initWakeup();
+		void timerSiftUp(size_t pos);
+		void timerSiftDown(size_t pos);
+		void timerPush(TimeEvent* te);
+		void timerRemove(TimeEvent* te);
 	public:
 		EventLoop();
 		~EventLoop();
 
-		int init(int size);
+		int init(int size, int api = AE_API_DEFAULT);
+		int getSetSize() const;
+		int resizeSetSize(int setsize);
+		/* createFileEvent() grows the fd table on its own for an fd past
+		* its end, up to 'limit' fds; 0 (the default) means no limit. */
+		void setSetSizeLimit(int limit){
+			this->setsizeLimit = limit;
+		}
 		void stop();
-		int createFileEvent(FileEvent* event,int fd);
+		int createFileEvent(int fd, int mask, FileProc_t* proc, void* clientData);
 		void deleteFileEvent(int fd, int mask);
 		int getFileEvents(int fd);
+		/* Deadlines are relative to now(), the cached clock, from the
+		* handlers, tasks and timers of an iteration; anywhere else, like in
+		* setup code or a sleep hook, the clock is read again first. */
 		long createTimeEvent(TimeEvent* event,long milliseconds);
+		long createTimeEventUs(TimeEvent* event,long long microseconds);
 		int deleteTimeEvent(long id);
+		int rescheduleTimeEvent(long id,long milliseconds);
+		int rescheduleTimeEventUs(long id,long long microseconds);
 		int processEvents(int flags);
 		void main();
+		void post(LoopTask* task);
+		void runInLoop(LoopTask* task);
+		int isInLoopThread() const;
 		const char* getName() const;
+		const PollStats& getPollStats() const;
+		/* The latency histograms cost a few clock reads per iteration, so
+		* they are only filled once tracking is turned on. */
+		void setLatencyTracking(int enabled){
+			this->latencyTracking = enabled;
+		}
+		/* Busy poll: once idle, main() keeps polling without blocking for
+		* 'microseconds' before it goes to sleep in the poll. Burns a core
+		* to save the wake-up latency; 0 (the default) disables it. */
+		void setBusyPoll(long long microseconds){
+			this->busyPollUs = microseconds > 0 ? microseconds : 0;
+		}
+		long long getBusyPoll() const{
+			return this->busyPollUs;
+		}
+		void setHandlerBudget(const HandlerBudget& budget){
+			this->budget = budget;
+		}
+		const HandlerBudget& getHandlerBudget() const{
+			return this->budget;
+		}
+		int overBudget(size_t bytes, long commands) const;
+		void yield(int fd, int mask);
+		const LoopStats& getLoopStats() const{
+			return this->loopStats;
+		}
+		void resetLoopStats(){
+			this->loopStats.reset();
+		}
+		size_t getLoopStatsInfo(char* buf, size_t len) const;
+		/* The single before sleep callback, run ahead of the hook list */
 		void setBeforeSleepProc(BeforeSleepProc_t* sleepProc){
 			this->beforeSleepProc = sleepProc;
 		}
+		long addSleepHook(int when, int order, SleepHookProc_t* proc,
+			void* clientData, long long budgetUs = 0);
+		int removeSleepHook(long id);
+		/* Monotonic time in microseconds, read once per iteration right after
+		* the poll returns. Handlers should use it instead of reading the clock,
+		* and timers created from a handler are relative to it. Outside of
+		* event processing it is only as recent as the last iteration. */
+		long long now() const{
+			return this->now_us;
+		}
+		long long updateTime();
+		long long timerBase();
+		/* Read CLOCK_MONOTONIC_COARSE where available: cheaper, but only
+		* precise to the kernel tick, so don't use it with sub-ms timers. */
+		void setCoarseClock(int coarse){
+			this->coarseClock = coarse;
+		}
 		//////////////////////////////////////////////////////////////////////////
 		static int wait(int fd,int mask,long milliseconds);
+		static long long monotonicTime(int coarse = 0);
 	};
 
 }
@@ -3,79 +3,198 @@
 /************************************************************************/
 #include <sys/epoll.h>
 
-struct PollCtrl : public PollCtrlBase{
+/* Interest changes are not applied right away: addEvent() and delEvent()
+* only record the mask we want for the fd, and flush() applies the net
+* change of every touched fd just before epoll_wait(). A reply toggles
+* AE_WRITABLE on and off within the same iteration, and that now costs no
+* epoll_ctl() at all.
+*
+* The one exception is removing the last event of an fd: the caller is
+* likely about to close() it and maybe get the same number back from the
+* next accept(), so the EPOLL_CTL_DEL is issued at once.
+*
+* The AE_EDGE and AE_EXCLUSIVE flags travel in the masks along with the
+* events, see ae.h for what they mean to the handlers. */
+struct EpollCtrl : public PollCtrlBase{
 	int epfd;
+	int pwait2; /* epoll_pwait2() is usable, for sub-millisecond timeouts */
 	std::vector<epoll_event> evts;
+	std::vector<int> kmasks;  /* mask registered in the kernel */
+	std::vector<int> wanted;  /* mask asked for by the event loop */
+	std::vector<char> dirty;  /* fd is in 'changes' */
+	std::vector<int> changes; /* fds to look at in the next flush() */
+	std::vector<int> broken;  /* fds epoll_ctl() failed on, see flush() */
 	
-	PollCtrl()
-		:epfd(-1)
+	EpollCtrl()
+		:epfd(-1),pwait2(1)
 	{}
 	
-	~PollCtrl(){
+	~EpollCtrl(){
 		if (this->epfd != -1){
 			::close(this->epfd);
 		}
 	}
 	
 	int init(int size){
-		this->events.resize(size);
-		this->fired.resize(size);
-		this->evts.resize(size);
+		this->fired.resize(AE_POLL_BATCH);
+		this->evts.resize(AE_POLL_BATCH);
 		this->epfd = epoll_create(1024);
 		if (this->epfd == -1){
 			return -1;
 		}
+		return this->resize(size);
+	}
+
+	/* The caller made sure no fd past 'size' is registered anymore */
+	int resize(int size){
+		this->flush();
+		for (size_t i = 0; i < this->broken.size(); ) {
+			if (this->broken[i] >= size) {
+				this->broken[i] = this->broken.back();
+				this->broken.pop_back();
+			} else {
+				++ i;
+			}
+		}
+		this->events.resize(size);
+		this->kmasks.resize(size,AE_NONE);
+		this->wanted.resize(size,AE_NONE);
+		this->dirty.resize(size,0);
 		return 0;
 	}
 	
-	int addEvent(int fd, int mask){
-		/* If the fd was already monitored for some event, we need a MOD
-		* operation. Otherwise we need an ADD operation. */
-		int op = this->events[fd]->mask == AE_NONE ?  EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+	void setMask(int fd, int mask){
+		if (!(mask & AE_IO_EVENTS)) {
+			mask = AE_NONE; /* flags alone don't keep the fd registered */
+		}
+		if (this->wanted[fd] == mask) {
+			return;
+		}
+		this->wanted[fd] = mask;
+		this->stats.changes ++;
+		if (mask == AE_NONE && this->kmasks[fd] != AE_NONE) {
+			this->ctl(fd,EPOLL_CTL_DEL,AE_NONE);
+			this->kmasks[fd] = AE_NONE;
+			return;
+		}
+		if (!this->dirty[fd]) {
+			this->dirty[fd] = 1;
+			this->changes.push_back(fd);
+		}
+	}
+	
+	int ctl(int fd, int op, int mask){
 		struct epoll_event ee;
 		ee.events = 0;
 		ee.data.u64 = 0; /* avoid valgrind warning */
 		ee.data.fd = fd;
-		mask |= this->events[fd]->mask; /* Merge old events */
 		if (mask & AE_READABLE) {
 			ee.events |= EPOLLIN;
 		}
 		if (mask & AE_WRITABLE) {
 			ee.events |= EPOLLOUT;
 		}
-		if (epoll_ctl(this->epfd,op,fd,&ee) == -1){
-			return -1;
+		if (mask & AE_EDGE) {
+			ee.events |= EPOLLET;
+		}
+#ifdef EPOLLEXCLUSIVE
+		/* Only valid on EPOLL_CTL_ADD, see flush() */
+		if ((mask & AE_EXCLUSIVE) && op == EPOLL_CTL_ADD) {
+			ee.events |= EPOLLEXCLUSIVE;
 		}
+#endif
+		this->stats.syscalls ++;
+		/* Note, Kernel < 2.6.9 requires a non null event pointer even for
+		* EPOLL_CTL_DEL. */
+		return epoll_ctl(this->epfd,op,fd,&ee);
+	}
+	
+	/* Apply the net interest change of every fd touched since the last
+	* call. Changes that cancelled out (add then delete, or AE_WRITABLE on
+	* and off again) are dropped here without a syscall. */
+	void flush(){
+		for (size_t i = 0; i < this->changes.size(); ++ i) {
+			int fd = this->changes[i];
+			this->dirty[fd] = 0;
+			int mask = this->wanted[fd];
+			int kmask = this->kmasks[fd];
+			if (mask == kmask) {
+				continue;
+			}
+			int op = kmask == AE_NONE ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+#ifdef EPOLLEXCLUSIVE
+			if (op == EPOLL_CTL_MOD && ((mask|kmask) & AE_EXCLUSIVE)) {
+				/* The kernel refuses to modify an exclusive registration,
+				* or to make one exclusive: register it again instead. */
+				this->ctl(fd,EPOLL_CTL_DEL,AE_NONE);
+				op = EPOLL_CTL_ADD;
+			}
+#endif
+			if (this->ctl(fd,op,mask) == -1) {
+				/* Out of sync with the kernel: retry the other way round */
+				if (errno == ENOENT && op == EPOLL_CTL_MOD) {
+					op = EPOLL_CTL_ADD;
+				} else if (errno == EEXIST && op == EPOLL_CTL_ADD) {
+					op = EPOLL_CTL_MOD;
+				} else {
+					op = -1;
+				}
+				if (op == -1 || this->ctl(fd,op,mask) == -1) {
+					/* We can't report the error to whoever registered the
+					* fd anymore. Fire it instead, so that its handler hits
+					* the error on its next read or write. */
+					this->broken.push_back(fd);
+					this->kmasks[fd] = AE_NONE;
+					continue;
+				}
+			}
+			this->kmasks[fd] = mask;
+		}
+		this->changes.clear();
+	}
+	
+	/* Like the other layers, we're called with the new events only, or
+	* with the full mask: either way it is merged with what we have. */
+	int addEvent(int fd, int mask){
+		this->setMask(fd,this->wanted[fd] | mask);
 		return 0;
 	}
 	
 	void delEvent(int fd, int delmask){
-		struct epoll_event ee;
-		int mask = this->events[fd]->mask & (~delmask);
-
-		ee.events = 0;
-		if (mask & AE_READABLE) {
-			ee.events |= EPOLLIN;
-		}
-		if (mask & AE_WRITABLE) {
-			ee.events |= EPOLLOUT;
-		}
-		ee.data.u64 = 0; /* avoid valgrind warning */
-		ee.data.fd = fd;
-		if (mask != AE_NONE) {
-			epoll_ctl(this->epfd,EPOLL_CTL_MOD,fd,&ee);
-		} else {
-			/* Note, Kernel < 2.6.9 requires a non null event pointer even for
-			* EPOLL_CTL_DEL. */
-			epoll_ctl(this->epfd,EPOLL_CTL_DEL,fd,&ee);
-		}
+		this->setMask(fd,this->wanted[fd] & (~delmask));
 	}
 	
+	int wait(timeval* tvp){
+		int batch = static_cast<int>(this->evts.size());
+#ifdef HAVE_EPOLL_PWAIT2
+		if (this->pwait2) {
+			struct timespec ts;
+			if (tvp) {
+				ts.tv_sec = tvp->tv_sec;
+				ts.tv_nsec = tvp->tv_usec*1000;
+			}
+			int retval = epoll_pwait2(this->epfd,&this->evts[0],batch,tvp ? &ts : NULL,NULL);
+			if (retval != -1 || errno != ENOSYS) {
+				return retval;
+			}
+			this->pwait2 = 0;
+		}
+#endif
+		/* Round up, so that a timer less than 1ms away doesn't make us spin
+		* with a zero timeout until it expires. */
+		return epoll_wait(this->epfd,&this->evts[0],batch,
+			tvp ? (tvp->tv_sec*1000 + (tvp->tv_usec+999)/1000) : -1);
+	}
+
 	int poll(timeval* tvp,int maxfd){
 		int numevents = 0;
 
-		int retval = epoll_wait(this->epfd,&this->evts[0],
-			static_cast<int>(this->events.size()),tvp ? (tvp->tv_sec*1000 + tvp->tv_usec/1000) : -1);
+		this->flush();
+		struct timeval zero = {0, 0};
+		if (!this->broken.empty()) {
+			tvp = &zero;
+		}
+		int retval = this->wait(tvp);
 		if (retval > 0) {
 			numevents = retval;
 			struct epoll_event* begin = &this->evts[0];
@@ -85,13 +204,24 @@ struct PollCtrl : public PollCtrlBase{
 
 				if (e->events & EPOLLIN) mask |= AE_READABLE;
 				if (e->events & EPOLLOUT) mask |= AE_WRITABLE;
-				if (e->events & EPOLLERR) mask |= AE_WRITABLE;
+				if (e->events & EPOLLERR) mask |= AE_WRITABLE|AE_ERRQUEUE;
 				if (e->events & EPOLLHUP) mask |= AE_WRITABLE;
 
 				this->fired[j].fd = e->data.fd;
 				this->fired[j].mask = mask;
 			}
 		}
+		for (size_t i = 0; i < this->broken.size(); ++ i) {
+			int fd = this->broken[i];
+			if (this->wanted[fd] != AE_NONE &&
+				numevents < static_cast<int>(this->fired.size()))
+			{
+				this->fired[numevents].fd = fd;
+				this->fired[numevents].mask = this->wanted[fd] & AE_IO_EVENTS;
+				numevents ++;
+			}
+		}
+		this->broken.clear();
 		return numevents;
 	}
 	
@@ -99,3 +229,8 @@ struct PollCtrl : public PollCtrlBase{
 		return "epoll";
 	}
 };
+
+#ifndef HAVE_IO_URING
+struct PollCtrl : public EpollCtrl{
+};
+#endif
@@ -81,6 +81,12 @@ struct PollCtrl : public PollCtrlBase{
 			this->pending_fds[i] = -1;
 			this->pending_masks[i] = AE_NONE;
 		}
+		this->fired.resize(MAX_EVENT_BATCHSZ);
+		return this->resize(size);
+	}
+
+	int resize(int size){
+		this->events.resize(size);
 		return 0;
 	}
 
@@ -7,7 +7,7 @@
 
 struct PollCtrl : public PollCtrlBase{
 	int kqfd;
-	std::vector<kevent> events;
+	std::vector<struct kevent> evts;
 
 	PollCtrl()
 		:kqfd(-1)
@@ -20,13 +20,17 @@ struct PollCtrl : public PollCtrlBase{
 	}
 
 	int init(int size){
-		this->events.resize(size);
-		this->fired.resize(size);
-		this->events.resize(size);
+		this->fired.resize(AE_POLL_BATCH);
+		this->evts.resize(AE_POLL_BATCH);
 		this->kqfd = kqueue();
 		if (this->kqfd == -1) {
 			return -1;
 		}
+		return this->resize(size);
+	}
+
+	int resize(int size){
+		this->events.resize(size);
 		return 0;
 	}
 
@@ -65,14 +69,14 @@ struct PollCtrl : public PollCtrlBase{
 		int retval = 0;
 		int numevents = 0;
 
-		int setsize = static_cast<int>(this->events.size());
+		int batch = static_cast<int>(this->evts.size());
 		if (tvp != NULL) {
 			struct timespec timeout;
 			timeout.tv_sec = tvp->tv_sec;
 			timeout.tv_nsec = tvp->tv_usec * 1000;
-			retval = kevent(this->kqfd, NULL, 0, &this->evts[0], setsize,&timeout);
+			retval = kevent(this->kqfd, NULL, 0, &this->evts[0], batch,&timeout);
 		} else {
-			retval = kevent(this->kqfd, NULL, 0, &this->evts[0], setsize,NULL);
+			retval = kevent(this->kqfd, NULL, 0, &this->evts[0], batch,NULL);
 		}
 
 		if (retval > 0) {
@@ -20,11 +20,19 @@ struct PollCtrl : public PollCtrlBase{
 	}
 
 	int init(int size){
-		this->events.resize(size);
-		this->fired.resize(size);
+		this->fired.resize(AE_POLL_BATCH);
 		FD_ZERO(&this->rfds);
 		FD_ZERO(&this->wfds);
-		return 0; 
+		return this->resize(size);
+	}
+
+	int resize(int size){
+		if (size > FD_SETSIZE) {
+			errno = ERANGE;
+			return -1;
+		}
+		this->events.resize(size);
+		return 0;
 	}
 
 	int addEvent(int fd, int mask){
@@ -46,7 +54,8 @@ struct PollCtrl : public PollCtrlBase{
 
 		int retval = select(maxfd+1,&this->_rfds,&this->_wfds,NULL,tvp);
 		if (retval > 0) {
-			for (int j = 0; j <= maxfd; j++) {
+			int batch = static_cast<int>(this->fired.size());
+			for (int j = 0; j <= maxfd && numevents < batch; j++) {
 				int mask = 0;
 				FileEvent *fe = &this->events[j];
 
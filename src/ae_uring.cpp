@@ -0,0 +1,439 @@
+/************************************************************************/
+/*                                                                      */
+/************************************************************************/
+/* io_uring multiplexing layer, selected at runtime with AE_API_URING.
+*
+* Every registered fd gets a multishot IORING_OP_POLL_ADD, so the kernel
+* keeps reporting readiness without being re-armed. Mask changes only queue
+* SQEs: all of them are submitted by the same io_uring_enter() that waits
+* for the completions, so an iteration costs one syscall no matter how many
+* fds changed state.
+*
+* Note that a multishot poll fires on readiness *changes*, like EPOLLET: a
+* handler that leaves data in the socket buffer is not called again until
+* more data arrives, so handlers must read and write until EAGAIN. That is
+* the AE_EDGE contract, which holds here whether the flag is set or not;
+* AE_EXCLUSIVE is ignored, AE_ERRQUEUE works as with epoll.
+*
+* The ring is driven with raw syscalls on the uapi header, no liburing. If
+* it can't be set up the layer falls back to plain epoll. */
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <signal.h>
+
+namespace {
+	enum {
+		URING_MAX_ENTRIES = 4096,
+		/* Every registered fd can post a completion per round, and when the
+		* completion ring overflows the kernel cancels multishot polls. Size
+		* it for a busy round rather than for the submissions. */
+		URING_CQ_ENTRIES = 16384
+	};
+
+	/* user_data layout: fd in the low 32 bits, the registration generation
+	* above it, and the top bit for our own POLL_REMOVE requests, whose
+	* completions carry no event. */
+	const uint64_t URING_REMOVE_TAG = 1ULL << 63;
+
+	inline uint64_t uringUserData(int fd, unsigned gen){
+		return (static_cast<uint64_t>(gen & 0x7fffffff) << 32) | static_cast<uint32_t>(fd);
+	}
+
+	int uringSetup(unsigned entries, struct io_uring_params* p){
+		return static_cast<int>(syscall(__NR_io_uring_setup, entries, p));
+	}
+
+	int uringEnter(int fd, unsigned submit, unsigned wait, unsigned flags, void* arg, size_t argsz){
+		return static_cast<int>(syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, argsz));
+	}
+}
+
+struct PollCtrl : public EpollCtrl{
+	int uring; /* 0 when running on the epoll fallback */
+	int ringfd;
+	int multishot;
+	unsigned pending; /* SQEs queued and not submitted yet */
+
+	/* submission ring */
+	void* sqPtr;
+	size_t sqSize;
+	unsigned* sqHead;
+	unsigned* sqTail;
+	unsigned sqMask;
+	unsigned sqEntries;
+	unsigned* sqArray;
+	io_uring_sqe* sqes;
+	size_t sqesSize;
+
+	/* completion ring */
+	void* cqPtr;
+	size_t cqSize;
+	unsigned* cqHead;
+	unsigned* cqTail;
+	unsigned cqMask;
+	io_uring_cqe* cqes;
+
+	std::vector<int> masks;      /* mask armed in the kernel for each fd */
+	std::vector<unsigned> gens;  /* current registration of each fd */
+	std::vector<int> firedSlot;  /* fd -> slot in fired[] this round, or -1 */
+
+	/* Requests that found the submission ring full while the kernel
+	* refused to drain it, e.g. EBUSY with the completion ring overflowing.
+	* They are queued again at the start of the next poll(), which reaps
+	* the completions, and before it waits: the masks above are already
+	* what the caller asked for. */
+	std::vector<char> unarmed;      /* by fd: masks[fd] still to arm */
+	std::vector<int> deferredArms;
+	std::vector<uint64_t> deferredRemoves; /* user_data of the polls to remove */
+
+	PollCtrl()
+		:uring(0),ringfd(-1),multishot(1),pending(0),
+		sqPtr(MAP_FAILED),sqSize(0),sqHead(NULL),sqTail(NULL),sqMask(0),sqEntries(0),
+		sqArray(NULL),sqes(NULL),sqesSize(0),
+		cqPtr(MAP_FAILED),cqSize(0),cqHead(NULL),cqTail(NULL),cqMask(0),cqes(NULL)
+	{}
+
+	~PollCtrl(){
+		this->closeRing();
+	}
+
+	void closeRing(){
+		if (this->sqes != NULL) {
+			munmap(this->sqes,this->sqesSize);
+			this->sqes = NULL;
+		}
+		if (this->cqPtr != MAP_FAILED && this->cqPtr != this->sqPtr) {
+			munmap(this->cqPtr,this->cqSize);
+		}
+		if (this->sqPtr != MAP_FAILED) {
+			munmap(this->sqPtr,this->sqSize);
+		}
+		this->sqPtr = this->cqPtr = MAP_FAILED;
+		if (this->ringfd != -1) {
+			::close(this->ringfd);
+			this->ringfd = -1;
+		}
+		this->uring = 0;
+	}
+
+	int setupRing(int size){
+		struct io_uring_params p;
+		memset(&p,0,sizeof(p));
+		p.flags = IORING_SETUP_CQSIZE;
+		p.cq_entries = URING_CQ_ENTRIES;
+
+		unsigned entries = 1;
+		while (entries < static_cast<unsigned>(size) && entries < URING_MAX_ENTRIES) {
+			entries <<= 1;
+		}
+		this->ringfd = uringSetup(entries,&p);
+		if (this->ringfd == -1) {
+			return -1;
+		}
+		/* We need the timeout argument of io_uring_enter() (5.11) */
+		if (!(p.features & IORING_FEAT_EXT_ARG)) {
+			this->closeRing();
+			return -1;
+		}
+
+		this->sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+		this->cqSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+		if (p.features & IORING_FEAT_SINGLE_MMAP) {
+			if (this->cqSize > this->sqSize) this->sqSize = this->cqSize;
+			this->cqSize = this->sqSize;
+		}
+		this->sqPtr = mmap(NULL,this->sqSize,PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_POPULATE,this->ringfd,IORING_OFF_SQ_RING);
+		if (this->sqPtr == MAP_FAILED) {
+			this->closeRing();
+			return -1;
+		}
+		if (p.features & IORING_FEAT_SINGLE_MMAP) {
+			this->cqPtr = this->sqPtr;
+		} else {
+			this->cqPtr = mmap(NULL,this->cqSize,PROT_READ|PROT_WRITE,
+				MAP_SHARED|MAP_POPULATE,this->ringfd,IORING_OFF_CQ_RING);
+			if (this->cqPtr == MAP_FAILED) {
+				this->closeRing();
+				return -1;
+			}
+		}
+		this->sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+		void* sqes = mmap(NULL,this->sqesSize,PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_POPULATE,this->ringfd,IORING_OFF_SQES);
+		if (sqes == MAP_FAILED) {
+			this->closeRing();
+			return -1;
+		}
+		this->sqes = reinterpret_cast<io_uring_sqe*>(sqes);
+
+		char* sq = reinterpret_cast<char*>(this->sqPtr);
+		this->sqHead = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+		this->sqTail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+		this->sqMask = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+		this->sqEntries = p.sq_entries;
+		this->sqArray = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+
+		char* cq = reinterpret_cast<char*>(this->cqPtr);
+		this->cqHead = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+		this->cqTail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+		this->cqMask = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+		this->cqes = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+		this->uring = 1;
+		return 0;
+	}
+
+	int init(int size){
+		/* The ring is sized by the poll batch: the fd table can grow later */
+		if (this->api == AE_API_URING && this->setupRing(AE_POLL_BATCH) == 0) {
+			this->fired.resize(AE_POLL_BATCH);
+			return this->resize(size);
+		}
+		return EpollCtrl::init(size);
+	}
+
+	int resize(int size){
+		if (!this->uring) {
+			return EpollCtrl::resize(size);
+		}
+		this->events.resize(size);
+		this->masks.resize(size,AE_NONE);
+		this->gens.resize(size,0);
+		this->firedSlot.resize(size,-1);
+		this->unarmed.resize(size,0);
+		return 0;
+	}
+
+	int sqFull() const{
+		return *this->sqTail - __atomic_load_n(this->sqHead,__ATOMIC_ACQUIRE) >= this->sqEntries;
+	}
+
+	/* Returns a zeroed SQE, submitting what is queued if the ring is full,
+	* or NULL if that submission failed: the slots are still the kernel's,
+	* so the request must be deferred. */
+	io_uring_sqe* getSqe(){
+		if (this->sqFull() && (this->submit() == -1 || this->sqFull())) {
+			return NULL;
+		}
+		unsigned tail = *this->sqTail;
+		unsigned idx = tail & this->sqMask;
+		io_uring_sqe* sqe = this->sqes + idx;
+		memset(sqe,0,sizeof(*sqe));
+		this->sqArray[idx] = idx;
+		return sqe;
+	}
+
+	void pushSqe(){
+		__atomic_store_n(this->sqTail,*this->sqTail + 1,__ATOMIC_RELEASE);
+		this->pending ++;
+	}
+
+	int submit(){
+		while (this->pending) {
+			this->stats.syscalls ++;
+			int ret = uringEnter(this->ringfd,this->pending,0,0,NULL,0);
+			if (ret < 0) {
+				if (errno == EINTR) continue;
+				return -1;
+			}
+			if (ret == 0) {
+				return -1;
+			}
+			this->pending -= ret;
+		}
+		return 0;
+	}
+
+	void armPoll(int fd, int mask){
+		this->masks[fd] = mask;
+		io_uring_sqe* sqe = this->getSqe();
+		if (sqe == NULL) {
+			if (!this->unarmed[fd]) {
+				this->unarmed[fd] = 1;
+				this->deferredArms.push_back(fd);
+			}
+			return;
+		}
+		this->unarmed[fd] = 0;
+		unsigned events = 0;
+		if (mask & AE_READABLE) events |= POLLIN;
+		if (mask & AE_WRITABLE) events |= POLLOUT;
+#if BYTE_ORDER == BIG_ENDIAN
+		events = (events << 16) | (events >> 16);
+#endif
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = fd;
+		sqe->poll32_events = events;
+		sqe->len = this->multishot ? IORING_POLL_ADD_MULTI : 0;
+		sqe->user_data = uringUserData(fd,++ this->gens[fd]);
+		this->pushSqe();
+	}
+
+	void removePoll(uint64_t userData){
+		io_uring_sqe* sqe = this->getSqe();
+		if (sqe == NULL) {
+			this->deferredRemoves.push_back(userData);
+			return;
+		}
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->fd = -1;
+		sqe->addr = userData;
+		sqe->user_data = URING_REMOVE_TAG;
+		this->pushSqe();
+	}
+
+	void disarmPoll(int fd){
+		if (this->unarmed[fd]) {
+			/* Never reached the kernel */
+			this->unarmed[fd] = 0;
+		} else {
+			this->removePoll(uringUserData(fd,this->gens[fd]));
+		}
+		/* Completions of the old registration are stale from now on */
+		this->gens[fd] ++;
+		this->masks[fd] = AE_NONE;
+	}
+
+	/* Queue the deferred requests again, while the ring has room */
+	void queueDeferred(){
+		while (!this->deferredRemoves.empty() && !this->sqFull()) {
+			uint64_t userData = this->deferredRemoves.back();
+			this->deferredRemoves.pop_back();
+			this->removePoll(userData);
+		}
+		while (!this->deferredArms.empty() && !this->sqFull()) {
+			int fd = this->deferredArms.back();
+			this->deferredArms.pop_back();
+			if (this->unarmed[fd]) {
+				this->unarmed[fd] = 0;
+				this->armPoll(fd,this->masks[fd]);
+			}
+		}
+	}
+
+	/* Like the other layers, we're called with the full mask: what is
+	* already registered plus the new bits. */
+	int addEvent(int fd, int mask){
+		if (!this->uring) {
+			return EpollCtrl::addEvent(fd,mask);
+		}
+		mask |= this->masks[fd];
+		if (!(mask & AE_IO_EVENTS)) {
+			return 0;
+		}
+		if (mask != this->masks[fd]) {
+			this->stats.changes ++;
+			if (this->masks[fd] != AE_NONE) {
+				this->disarmPoll(fd);
+			}
+			this->armPoll(fd,mask);
+		}
+		return 0;
+	}
+
+	void delEvent(int fd, int delmask){
+		if (!this->uring) {
+			EpollCtrl::delEvent(fd,delmask);
+			return;
+		}
+		int mask = this->masks[fd] & (~delmask);
+		if (!(mask & AE_IO_EVENTS)) {
+			mask = AE_NONE;
+		}
+		if (mask != this->masks[fd]) {
+			this->stats.changes ++;
+			this->disarmPoll(fd);
+			if (mask != AE_NONE) {
+				this->armPoll(fd,mask);
+			}
+		}
+	}
+
+	int poll(timeval* tvp,int maxfd){
+		if (!this->uring) {
+			return EpollCtrl::poll(tvp,maxfd);
+		}
+
+		/* Submit the queued SQEs and wait for completions in one syscall */
+		this->queueDeferred();
+		struct __kernel_timespec ts;
+		struct io_uring_getevents_arg arg;
+		memset(&arg,0,sizeof(arg));
+		unsigned wait = 1;
+		if (tvp) {
+			ts.tv_sec = tvp->tv_sec;
+			ts.tv_nsec = tvp->tv_usec*1000;
+			arg.ts = reinterpret_cast<uint64_t>(&ts);
+			if (tvp->tv_sec == 0 && tvp->tv_usec == 0) wait = 0;
+		}
+		arg.sigmask_sz = _NSIG / 8;
+		int ret = uringEnter(this->ringfd,this->pending,wait,
+			IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG,&arg,sizeof(arg));
+		if (ret > 0) {
+			this->pending -= ret;
+		}
+
+		int numevents = 0;
+		unsigned head = *this->cqHead;
+		unsigned tail = __atomic_load_n(this->cqTail,__ATOMIC_ACQUIRE);
+		for (; head != tail; head ++) {
+			io_uring_cqe* cqe = this->cqes + (head & this->cqMask);
+			if (cqe->user_data & URING_REMOVE_TAG) {
+				continue;
+			}
+			int fd = static_cast<int>(cqe->user_data & 0xffffffff);
+			if (fd >= static_cast<int>(this->gens.size()) ||
+				uringUserData(fd,this->gens[fd]) != cqe->user_data)
+			{
+				continue; /* stale: the fd was re-registered since */
+			}
+			if (this->firedSlot[fd] == -1 &&
+				numevents == static_cast<int>(this->fired.size()))
+			{
+				break; /* batch full: leave the rest for the next round */
+			}
+			if (!(cqe->flags & IORING_CQE_F_MORE)) {
+				/* The poll is gone (one shot, error, or the kernel gave up
+				* on it): arm it again on the next submission. */
+				int armed = this->masks[fd];
+				this->masks[fd] = AE_NONE;
+				if (cqe->res == -EINVAL && this->multishot) {
+					this->multishot = 0;
+				}
+				if (armed != AE_NONE && cqe->res != -EBADF) {
+					this->armPoll(fd,armed);
+				}
+			}
+			if (cqe->res <= 0) {
+				continue;
+			}
+
+			int mask = 0;
+			if (cqe->res & POLLIN) mask |= AE_READABLE;
+			if (cqe->res & POLLOUT) mask |= AE_WRITABLE;
+			if (cqe->res & POLLERR) mask |= AE_WRITABLE|AE_ERRQUEUE;
+			if (cqe->res & POLLHUP) mask |= AE_WRITABLE;
+			/* A multishot poll can complete several times per round */
+			if (this->firedSlot[fd] != -1) {
+				this->fired[this->firedSlot[fd]].mask |= mask;
+				continue;
+			}
+
+			this->firedSlot[fd] = numevents;
+			this->fired[numevents].fd = fd;
+			this->fired[numevents].mask = mask;
+			numevents ++;
+		}
+		__atomic_store_n(this->cqHead,head,__ATOMIC_RELEASE);
+
+		for (int j = 0; j < numevents; j ++) {
+			this->firedSlot[this->fired[j].fd] = -1;
+		}
+		return numevents;
+	}
+
+	const char* getName() const{
+		return this->uring ? "io_uring" : EpollCtrl::getName();
+	}
+};
@@ -3,6 +3,7 @@
 /************************************************************************/
 #include "fmacros.h"
 #include "anet.h"
+#include "config.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -18,6 +19,26 @@
 #include <errno.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <limits.h>
+#ifdef __linux__
+#include <linux/filter.h>
+#endif
+#ifdef HAVE_MSG_ZEROCOPY
+#include <linux/errqueue.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#ifdef HAVE_MSG_ZEROCOPY
+/* Linux 4.14, older C libraries lack them */
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#endif
 
 namespace redis{ namespace {
 	void anetSetError(char *err, const char *fmt, ...)
@@ -40,6 +61,42 @@ namespace redis{ namespace {
 		return ANET_OK;
 	}
 
+	/* TCP_NOPUSH is the BSD flavour of TCP_CORK */
+	int anetSetTcpCork(char *err, int fd, int val)
+	{
+#if defined(TCP_CORK)
+		if (setsockopt(fd, IPPROTO_TCP, TCP_CORK, &val, sizeof(val)) == -1)
+		{
+			anetSetError(err, "setsockopt TCP_CORK: %s", strerror(errno));
+			return ANET_ERR;
+		}
+		return ANET_OK;
+#elif defined(TCP_NOPUSH)
+		if (setsockopt(fd, IPPROTO_TCP, TCP_NOPUSH, &val, sizeof(val)) == -1)
+		{
+			anetSetError(err, "setsockopt TCP_NOPUSH: %s", strerror(errno));
+			return ANET_ERR;
+		}
+		return ANET_OK;
+#else
+		(void)fd; (void)val;
+		anetSetError(err, "TCP_CORK is not supported on this system");
+		return ANET_ERR;
+#endif
+	}
+
+#ifdef __linux__
+	struct sock_filter anetBpfInsn(unsigned short code, unsigned char jt, unsigned char jf, int k)
+	{
+		struct sock_filter insn;
+		insn.code = code;
+		insn.jt = jt;
+		insn.jf = jf;
+		insn.k = static_cast<unsigned>(k);
+		return insn;
+	}
+#endif
+
 	int anetCreateSocket(char *err, int domain) {
 		int s, on = 1;
 		if ((s = socket(domain, SOCK_STREAM, 0)) == -1) {
@@ -133,6 +190,19 @@ int anetDisableTcpNoDelay(char *err, int fd)
 	return anetSetTcpNoDelay(err, fd, 0);
 }
 
+/* Hold back partial segments until anetDisableTcpCork(): the writes done
+* in between leave in full segments, and the rest is pushed at once when
+* the cork is removed. */
+int anetEnableTcpCork(char *err, int fd)
+{
+	return anetSetTcpCork(err, fd, 1);
+}
+
+int anetDisableTcpCork(char *err, int fd)
+{
+	return anetSetTcpCork(err, fd, 0);
+}
+
 
 int anetSetSendBuffer(char *err, int fd, int buffsize)
 {
@@ -144,6 +214,92 @@ int anetSetSendBuffer(char *err, int fd, int buffsize)
 	return ANET_OK;
 }
 
+/* With 'seconds' 0, close() resets the connection and drops whatever is
+* still queued for sending, instead of the usual graceful close */
+int anetSetLinger(char *err, int fd, int seconds)
+{
+	struct linger l;
+	l.l_onoff = 1;
+	l.l_linger = seconds;
+	if (setsockopt(fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l)) == -1)
+	{
+		anetSetError(err, "setsockopt SO_LINGER: %s", strerror(errno));
+		return ANET_ERR;
+	}
+	return ANET_OK;
+}
+
+/* Let blocking reads and polls on this socket spin on the device queue for
+* up to 'usecs' microseconds before sleeping (Linux SO_BUSY_POLL). Trades
+* CPU for a lower wake-up latency; raising the value above the
+* net.core.busy_read default needs CAP_NET_ADMIN. */
+int anetSetBusyPoll(char *err, int fd, int usecs)
+{
+#ifdef SO_BUSY_POLL
+	if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) == -1)
+	{
+		anetSetError(err, "setsockopt SO_BUSY_POLL: %s", strerror(errno));
+		return ANET_ERR;
+	}
+	return ANET_OK;
+#else
+	(void)fd; (void)usecs;
+	anetSetError(err, "setsockopt SO_BUSY_POLL: not supported");
+	return ANET_ERR;
+#endif
+}
+
+/* Accept data in the SYN of clients holding a Fast Open cookie, so their
+* first command costs no round trip of its own. 'qlen' caps the pending
+* Fast Open connections that haven't been accepted yet. The system must
+* allow it on the server side too (net.ipv4.tcp_fastopen & 2 on Linux). */
+int anetTcpFastOpen(char *err, int fd, int qlen)
+{
+#ifdef TCP_FASTOPEN
+	if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen)) == -1)
+	{
+		anetSetError(err, "setsockopt TCP_FASTOPEN: %s", strerror(errno));
+		return ANET_ERR;
+	}
+	return ANET_OK;
+#else
+	(void)fd; (void)qlen;
+	anetSetError(err, "setsockopt TCP_FASTOPEN: not supported");
+	return ANET_ERR;
+#endif
+}
+
+/* Only wake up the listener for connections that sent data, or after
+* 'seconds' without any: the accept and the first read then come together,
+* and idle or half-made connections never reach the event loop. */
+int anetTcpDeferAccept(char *err, int fd, int seconds)
+{
+#ifdef TCP_DEFER_ACCEPT
+	if (setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &seconds, sizeof(seconds)) == -1)
+	{
+		anetSetError(err, "setsockopt TCP_DEFER_ACCEPT: %s", strerror(errno));
+		return ANET_ERR;
+	}
+	return ANET_OK;
+#else
+	(void)fd; (void)seconds;
+	anetSetError(err, "setsockopt TCP_DEFER_ACCEPT: not supported");
+	return ANET_ERR;
+#endif
+}
+
+/* Apply 'opts' to a listening socket. Every option is tried, the error
+* reported is the last one. */
+int anetSetListenOptions(char *err, int fd, const AnetListenOptions *opts)
+{
+	int retval = ANET_OK;
+	if (opts->fastopen && anetTcpFastOpen(err,fd,opts->fastopen) == ANET_ERR)
+		retval = ANET_ERR;
+	if (opts->deferaccept && anetTcpDeferAccept(err,fd,opts->deferaccept) == ANET_ERR)
+		retval = ANET_ERR;
+	return retval;
+}
+
 int anetTcpKeepAlive(char *err, int fd)
 {
 	int yes = 1;
@@ -288,6 +444,99 @@ int anetWrite(int fd, char *buf, int count)
 	return totlen;
 }
 
+static ssize_t anetSendv(int fd, const struct iovec *iov, int iovcnt, int flags)
+{
+	struct msghdr msg;
+	int max = ANET_IOV_MAX;
+#ifdef IOV_MAX
+	if (max > IOV_MAX) max = IOV_MAX;
+#endif
+	memset(&msg,0,sizeof(msg));
+	msg.msg_iov = const_cast<struct iovec*>(iov);
+	msg.msg_iovlen = iovcnt < max ? iovcnt : max;
+	return sendmsg(fd,&msg,flags|MSG_NOSIGNAL);
+}
+
+/* Gather write of 'iovcnt' buffers to the socket 'fd' with a single
+* sendmsg(2), so a reply made of scattered fragments needs no copy into a
+* flat buffer. At most ANET_IOV_MAX (or the system IOV_MAX, if lower)
+* buffers are sent per call. Like write(2) on a non blocking socket it
+* returns what the kernel took, which may be less than asked: the caller
+* resumes from there. Returns -1 with errno set on error, EAGAIN included. */
+ssize_t anetWritev(int fd, const struct iovec *iov, int iovcnt)
+{
+	return anetSendv(fd,iov,iovcnt,0);
+}
+
+/* Like anetWritev() but with MSG_ZEROCOPY: the kernel sends from the
+* caller's pages instead of copying them, so the buffers must stay
+* untouched until the completion of this send is read with
+* anetZeroCopyCompletion(). The sends that take data are numbered from 0,
+* per socket. Needs anetEnableZeroCopy() first. */
+ssize_t anetWritevZeroCopy(int fd, const struct iovec *iov, int iovcnt)
+{
+#ifdef HAVE_MSG_ZEROCOPY
+	return anetSendv(fd,iov,iovcnt,MSG_ZEROCOPY);
+#else
+	return anetSendv(fd,iov,iovcnt,0);
+#endif
+}
+
+int anetEnableZeroCopy(char *err, int fd)
+{
+#ifdef HAVE_MSG_ZEROCOPY
+	int yes = 1;
+	if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &yes, sizeof(yes)) == -1) {
+		anetSetError(err, "setsockopt SO_ZEROCOPY: %s", strerror(errno));
+		return ANET_ERR;
+	}
+	return ANET_OK;
+#else
+	anetSetError(err, "MSG_ZEROCOPY is not supported on this system");
+	return ANET_ERR;
+#endif
+}
+
+/* Read one message from the error queue of 'fd'. For a MSG_ZEROCOPY
+* completion, sends 'lo' to 'hi' (inclusive, wrapping around) are done with
+* their buffers and 1 is returned; 'copied' is set when the kernel copied
+* the data after all (loopback, or a device without scatter-gather), in
+* which case zero copy is only overhead for this socket. Returns 0 when
+* the queue is empty or had something else, -1 on error. */
+int anetZeroCopyCompletion(int fd, uint32_t *lo, uint32_t *hi, int *copied)
+{
+#ifdef HAVE_MSG_ZEROCOPY
+	char control[128];
+	struct msghdr msg;
+	memset(&msg,0,sizeof(msg));
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	if (recvmsg(fd,&msg,MSG_ERRQUEUE|MSG_DONTWAIT) == -1) {
+		return errno == EAGAIN ? 0 : -1;
+	}
+	for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg,cm)) {
+		if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+			(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+		{
+			continue;
+		}
+		struct sock_extended_err serr;
+		memcpy(&serr,CMSG_DATA(cm),sizeof(serr));
+		if (serr.ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr.ee_errno != 0) {
+			continue;
+		}
+		*lo = serr.ee_info;
+		*hi = serr.ee_data;
+		*copied = (serr.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0;
+		return 1;
+	}
+	return 0;
+#else
+	(void)fd; (void)lo; (void)hi; (void)copied;
+	return 0;
+#endif
+}
+
 static int anetListen(char *err, int s, struct sockaddr *sa, socklen_t len) {
 	if (bind(s,sa,len) == -1) {
 		anetSetError(err, "bind: %s", strerror(errno));
@@ -306,7 +555,9 @@ static int anetListen(char *err, int s, struct sockaddr *sa, socklen_t len) {
 	return ANET_OK;
 }
 
-int anetTcpServer(char *err, int port, char *bindaddr)
+#define ANET_SERVER_NONE 0
+#define ANET_SERVER_REUSEPORT 1
+static int anetTcpGenericServer(char *err, int port, char *bindaddr, int flags)
 {
 	int s;
 	struct sockaddr_in sa;
@@ -314,6 +565,23 @@ int anetTcpServer(char *err, int port, char *bindaddr)
 	if ((s = anetCreateSocket(err,AF_INET)) == ANET_ERR)
 		return ANET_ERR;
 
+	if (flags & ANET_SERVER_REUSEPORT) {
+#ifdef SO_REUSEPORT
+		/* Every socket bound with SO_REUSEPORT gets its own accept queue
+		* and the kernel spreads incoming connections across them. */
+		int on = 1;
+		if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1) {
+			anetSetError(err, "setsockopt SO_REUSEPORT: %s", strerror(errno));
+			close(s);
+			return ANET_ERR;
+		}
+#else
+		anetSetError(err, "SO_REUSEPORT not supported");
+		close(s);
+		return ANET_ERR;
+#endif
+	}
+
 	memset(&sa,0,sizeof(sa));
 	sa.sin_family = AF_INET;
 	sa.sin_port = htons(port);
@@ -328,6 +596,96 @@ int anetTcpServer(char *err, int port, char *bindaddr)
 	return s;
 }
 
+int anetTcpServer(char *err, int port, char *bindaddr)
+{
+	return anetTcpGenericServer(err,port,bindaddr,ANET_SERVER_NONE);
+}
+
+/* Like anetTcpServer() but the socket is bound with SO_REUSEPORT, so that
+* several listeners (one per event loop thread) can share the same port. */
+int anetTcpReusePortServer(char *err, int port, char *bindaddr)
+{
+	return anetTcpGenericServer(err,port,bindaddr,ANET_SERVER_REUSEPORT);
+}
+
+/* Create 'count' SO_REUSEPORT listeners on the same port, one per event
+* loop thread, in 'fds'. The kernel numbers the sockets of a reuseport
+* group in bind order, so fds[i] is socket i for the steering program of
+* anetReusePortSteerByCpu(). On error none of them is left open. */
+int anetTcpReusePortGroup(char *err, int port, char *bindaddr, int *fds, int count)
+{
+	for (int i = 0; i < count; i++) {
+		fds[i] = anetTcpReusePortServer(err,port,bindaddr);
+		if (fds[i] == ANET_ERR) {
+			while (i-- > 0) {
+				close(fds[i]);
+				fds[i] = -1;
+			}
+			return ANET_ERR;
+		}
+	}
+	return ANET_OK;
+}
+
+/* Ask the kernel to prefer this listener of a reuseport group for the
+* connections whose packets are processed on 'cpu' (SO_INCOMING_CPU), so
+* that the softirq work and the thread serving the connection share the
+* caches of that core. Meant for a listener whose thread is pinned there. */
+int anetSetIncomingCpu(char *err, int fd, int cpu)
+{
+#ifdef SO_INCOMING_CPU
+	if (setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) == -1)
+	{
+		anetSetError(err, "setsockopt SO_INCOMING_CPU: %s", strerror(errno));
+		return ANET_ERR;
+	}
+	return ANET_OK;
+#else
+	(void)fd; (void)cpu;
+	anetSetError(err, "setsockopt SO_INCOMING_CPU: not supported");
+	return ANET_ERR;
+#endif
+}
+
+/* Attach to the reuseport group of 'fd' a classic BPF program picking the
+* listener by the CPU that received the packet: socket i (in bind order)
+* takes the connections arriving on cpus[i], the others are spread by CPU
+* number modulo 'count'. Unlike SO_INCOMING_CPU this is a hard mapping,
+* it doesn't depend on how the kernel scores the listeners. */
+int anetReusePortSteerByCpu(char *err, int fd, const int *cpus, int count)
+{
+#if defined(SO_ATTACH_REUSEPORT_CBPF) && defined(SKF_AD_CPU)
+	if (count < 1 || count > (BPF_MAXINSNS-3)/2) {
+		anetSetError(err, "reuseport steering: bad group size %d", count);
+		return ANET_ERR;
+	}
+	struct sock_filter code[BPF_MAXINSNS];
+	int n = 0;
+	code[n++] = anetBpfInsn(BPF_LD|BPF_W|BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU);
+	for (int i = 0; i < count; i++) {
+		/* if (cpu == cpus[i]) return i; */
+		code[n++] = anetBpfInsn(BPF_JMP|BPF_JEQ|BPF_K, 0, 1, cpus[i]);
+		code[n++] = anetBpfInsn(BPF_RET|BPF_K, 0, 0, i);
+	}
+	code[n++] = anetBpfInsn(BPF_ALU|BPF_MOD|BPF_K, 0, 0, count);
+	code[n++] = anetBpfInsn(BPF_RET|BPF_A, 0, 0, 0);
+
+	struct sock_fprog prog;
+	prog.len = n;
+	prog.filter = code;
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == -1)
+	{
+		anetSetError(err, "setsockopt SO_ATTACH_REUSEPORT_CBPF: %s", strerror(errno));
+		return ANET_ERR;
+	}
+	return ANET_OK;
+#else
+	(void)fd; (void)cpus; (void)count;
+	anetSetError(err, "reuseport steering: not supported");
+	return ANET_ERR;
+#endif
+}
+
 int anetUnixServer(char *err, char *path, mode_t perm)
 {
 	int s;
@@ -370,11 +728,78 @@ int anetTcpAccept(char *err, int s, char *ip, int *port) {
 	if ((fd = anetGenericAccept(err,s,(struct sockaddr*)&sa,&salen)) == ANET_ERR)
 		return ANET_ERR;
 
-	if (ip) strcpy(ip,inet_ntoa(sa.sin_addr));
+	/* inet_ntop(), not inet_ntoa(): reactors accept on several threads */
+	if (ip) inet_ntop(AF_INET,&sa.sin_addr,ip,INET_ADDRSTRLEN);
 	if (port) *port = ntohs(sa.sin_port);
 	return fd;
 }
 
+/* Take up to 'max' pending connections from the non blocking listener 's',
+* stopping early when there are no more. Each socket comes out non blocking
+* and close-on-exec from accept4() itself, with the options in 'opts' (if
+* any) applied, and its peer address in 'peers'. That saves the fcntl()
+* pairs and one readable event per connection when they arrive in bursts.
+*
+* Returns the number of connections taken, 0 if none was pending. A failure
+* after the first connection ends the batch early and is reported by the
+* next call; a failure on the first one returns ANET_ERR with errno set. */
+int anetTcpAcceptBatch(char *err, int s, AnetPeer *peers, int max,
+	const AnetAcceptOptions *opts)
+{
+	int count = 0;
+	while (count < max) {
+		struct sockaddr_storage sa;
+		socklen_t salen = sizeof(sa);
+#ifdef HAVE_ACCEPT4
+		int fd = accept4(s,(struct sockaddr*)&sa,&salen,SOCK_NONBLOCK|SOCK_CLOEXEC);
+#else
+		int fd = accept(s,(struct sockaddr*)&sa,&salen);
+		if (fd != -1 && (anetNonBlock(NULL,fd) == ANET_ERR ||
+			fcntl(fd,F_SETFD,FD_CLOEXEC) == -1))
+		{
+			close(fd);
+			continue;
+		}
+#endif
+		if (fd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			}
+			if (count == 0) {
+				anetSetError(err, "accept: %s", strerror(errno));
+				return ANET_ERR;
+			}
+			break;
+		}
+
+		AnetPeer *peer = peers + count;
+		peer->fd = fd;
+		peer->port = 0;
+		peer->ip[0] = '\0';
+		if (sa.ss_family == AF_INET) {
+			struct sockaddr_in *in = (struct sockaddr_in*)&sa;
+			inet_ntop(AF_INET,&in->sin_addr,peer->ip,sizeof(peer->ip));
+			peer->port = ntohs(in->sin_port);
+		} else if (sa.ss_family == AF_INET6) {
+			struct sockaddr_in6 *in6 = (struct sockaddr_in6*)&sa;
+			inet_ntop(AF_INET6,&in6->sin6_addr,peer->ip,sizeof(peer->ip));
+			peer->port = ntohs(in6->sin6_port);
+		}
+
+		if (opts) {
+			if (opts->nodelay) anetSetTcpNoDelay(NULL,fd,1);
+			if (opts->keepalive) anetKeepAlive(NULL,fd,opts->keepalive);
+			if (opts->busypoll) anetSetBusyPoll(NULL,fd,opts->busypoll);
+			if (opts->sndbuf) anetSetSendBuffer(NULL,fd,opts->sndbuf);
+		}
+		count ++;
+	}
+	return count;
+}
+
 int anetUnixAccept(char *err, int s) {
 	int fd;
 	struct sockaddr_un sa;
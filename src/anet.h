@@ -9,12 +9,46 @@
 #endif
 
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <stdint.h>
 
 namespace redis{
 	enum {
 		ANET_OK =  0,
 		ANET_ERR = -1,
-		ANET_ERR_LEN = 256
+		ANET_ERR_LEN = 256,
+		ANET_IP_LEN = 46, /* INET6_ADDRSTRLEN */
+		ANET_IOV_MAX = 1024 /* IOV_MAX on Linux and the BSDs */
+	};
+
+	/* A connection taken by anetTcpAcceptBatch() */
+	struct AnetPeer{
+		int fd;
+		int port;
+		char ip[ANET_IP_LEN];
+	};
+
+	/* Options anetTcpAcceptBatch() sets on every accepted socket. They are
+	* applied on a best effort basis: the peer may already be gone, and its
+	* first read or write will tell. 0 leaves the system default. */
+	struct AnetAcceptOptions{
+		int nodelay;
+		int keepalive; /* interval in seconds, see anetKeepAlive() */
+		int busypoll;  /* microseconds, see anetSetBusyPoll() */
+		int sndbuf;
+		AnetAcceptOptions()
+			:nodelay(0),keepalive(0),busypoll(0),sndbuf(0)
+		{}
+	};
+
+	/* Options of a listening socket, see anetSetListenOptions(). 0 leaves
+	* the system default. */
+	struct AnetListenOptions{
+		int fastopen;    /* queue length, see anetTcpFastOpen() */
+		int deferaccept; /* seconds, see anetTcpDeferAccept() */
+		AnetListenOptions()
+			:fastopen(0),deferaccept(0)
+		{}
 	};
 	int anetTcpConnect(char *err, char *addr, int port);
 	int anetTcpNonBlockConnect(char *err, char *addr, int port);
@@ -23,16 +57,34 @@ namespace redis{
 	int anetRead(int fd, char *buf, int count);
 	int anetResolve(char *err, char *host, char *ipbuf);
 	int anetTcpServer(char *err, int port, char *bindaddr);
+	int anetTcpReusePortServer(char *err, int port, char *bindaddr);
+	int anetTcpReusePortGroup(char *err, int port, char *bindaddr, int *fds, int count);
+	int anetSetIncomingCpu(char *err, int fd, int cpu);
+	int anetReusePortSteerByCpu(char *err, int fd, const int *cpus, int count);
 	int anetUnixServer(char *err, char *path, mode_t perm);
 	int anetTcpAccept(char *err, int serversock, char *ip, int *port);
+	int anetTcpAcceptBatch(char *err, int serversock, AnetPeer *peers, int max,
+		const AnetAcceptOptions *opts);
 	int anetUnixAccept(char *err, int serversock);
 	int anetWrite(int fd, char *buf, int count);
+	ssize_t anetWritev(int fd, const struct iovec *iov, int iovcnt);
+	ssize_t anetWritevZeroCopy(int fd, const struct iovec *iov, int iovcnt);
+	int anetEnableZeroCopy(char *err, int fd);
+	int anetZeroCopyCompletion(int fd, uint32_t *lo, uint32_t *hi, int *copied);
 	int anetNonBlock(char *err, int fd);
 	int anetEnableTcpNoDelay(char *err, int fd);
 	int anetDisableTcpNoDelay(char *err, int fd);
+	int anetEnableTcpCork(char *err, int fd);
+	int anetDisableTcpCork(char *err, int fd);
 	int anetTcpKeepAlive(char *err, int fd);
 	int anetPeerToString(int fd, char *ip, int *port);
 	int anetKeepAlive(char *err, int fd, int interval);
+	int anetSetBusyPoll(char *err, int fd, int usecs);
+	int anetSetSendBuffer(char *err, int fd, int buffsize);
+	int anetSetLinger(char *err, int fd, int seconds);
+	int anetTcpFastOpen(char *err, int fd, int qlen);
+	int anetTcpDeferAccept(char *err, int fd, int seconds);
+	int anetSetListenOptions(char *err, int fd, const AnetListenOptions *opts);
 }
 #endif // _REDIS_REDISCPP_ANET_H_
 
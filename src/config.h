@@ -49,6 +49,46 @@ inline int redis_stat(const char *fn, struct stat *buf){
 #define HAVE_EPOLL 1
 #endif
 
+/* Test for accept4(), to get non blocking close-on-exec sockets at once */
+#if defined(__linux__) || (defined(__FreeBSD__) && __FreeBSD__ >= 10)
+#define HAVE_ACCEPT4 1
+#endif
+
+/* Test for MSG_ZEROCOPY sends, with completions on the error queue */
+#ifdef __linux__
+#define HAVE_MSG_ZEROCOPY 1
+#endif
+
+/* Test for pthread_setaffinity_np(), to pin the reactor threads */
+#if defined(__linux__) && defined(__GLIBC__)
+#define HAVE_PTHREAD_AFFINITY 1
+#endif
+
+/* Test for the x86 SIMD intrinsics. The scanning functions of util.cpp
+* pick SSE2 or AVX2 at runtime, so nothing needs -mavx2 */
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && \
+	(__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9) || defined(__clang__))
+#define HAVE_X86_SIMD 1
+#endif
+
+/* Test for eventfd(), used to wake up an event loop from other threads */
+#ifdef __linux__
+#define HAVE_EVENTFD 1
+#endif
+
+/* Test for io_uring. The backend talks to the kernel directly, so only the
+ * uapi header is needed, with the bits of 5.13+ it relies on. The ring can
+ * still be unavailable at runtime (old kernel, seccomp): then the event loop
+ * falls back to epoll. */
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#if defined(IORING_ENTER_EXT_ARG) && defined(IORING_POLL_ADD_MULTI)
+#define HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
 #if (defined(__APPLE__) && defined(MAC_OS_X_VERSION_10_6)) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined (__NetBSD__)
 #define HAVE_KQUEUE 1
 #endif
@@ -87,6 +127,14 @@ inline int aof_fsync(int fd){
 #endif
 #endif
 
+/* Test for epoll_pwait2(), that takes a timespec timeout instead of
+ * milliseconds. The kernel may still lack it (ENOSYS, before 5.11). */
+#if defined(HAVE_EPOLL) && defined(__GLIBC__) && defined(__GLIBC_PREREQ)
+#if __GLIBC_PREREQ(2, 35)
+#define HAVE_EPOLL_PWAIT2 1
+#endif
+#endif
+
 #ifdef HAVE_SYNC_FILE_RANGE
 #define rdb_fsync_range(fd,off,size) sync_file_range(fd,off,size,SYNC_FILE_RANGE_WAIT_BEFORE|SYNC_FILE_RANGE_WRITE)
 #else
@@ -0,0 +1,613 @@
+/************************************************************************/
+/*                                                                      */
+/************************************************************************/
+#include "fmacros.h"
+#include "log.h"
+#include "networking.h"
+#include "anet.h"
+#include "consts.h"
+#include "util.h"
+#include "zmalloc.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+namespace redis{ namespace{
+	const char REPLY_OK[] = "+OK\r\n";
+	const char REPLY_PONG[] = "+PONG\r\n";
+	const char REPLY_EMPTY_ARRAY[] = "*0\r\n";
+	const char REPLY_SYNTAX_ERR[] = "-ERR syntax error\r\n";
+	const char REPLY_NOPROTO[] = "-NOPROTO unsupported protocol version\r\n";
+
+	enum {
+		ERR_MSG_LEN = 256,
+		CMD_NAME_LEN = 64
+	};
+
+	void pingCommand(Client* c){
+		if (c->argc > 2) {
+			c->addReplyError("wrong number of arguments for 'ping' command");
+		} else if (c->argc == 2) {
+			c->addReplyBulk(c->argv[1].ptr,c->argv[1].len);
+		} else {
+			c->addReply(REPLY_PONG,sizeof(REPLY_PONG)-1);
+		}
+	}
+
+	void echoCommand(Client* c){
+		c->addReplyBulk(c->argv[1].ptr,c->argv[1].len);
+	}
+
+	int setName(Client* c, const ArgView& name){
+		if (name.len >= CLIENT_NAME_LEN) {
+			c->addReplyError("Client names are limited to %d bytes",CLIENT_NAME_LEN-1);
+			return 0;
+		}
+		for (size_t j = 0; j < name.len; j++) {
+			if (name.ptr[j] <= ' ' || name.ptr[j] > '~') {
+				c->addReplyError("Client names cannot contain spaces, newlines or special characters.");
+				return 0;
+			}
+		}
+		memcpy(c->name,name.ptr,name.len);
+		c->name[name.len] = '\0';
+		return 1;
+	}
+
+	/* HELLO [protover [AUTH username password] [SETNAME name]] */
+	void helloCommand(Client* c){
+		int resp = c->reply.getResp();
+		int j = 1;
+		if (c->argc > 1) {
+			long ver = 0;
+			if (!string2ll(c->argv[1].ptr,c->argv[1].len,&ver) || ver < 2 || ver > 3) {
+				c->addReply(REPLY_NOPROTO,sizeof(REPLY_NOPROTO)-1);
+				return;
+			}
+			resp = static_cast<int>(ver);
+			j = 2;
+		}
+		if (resp != 3 && (c->flags & CLIENT_TRACKING)) {
+			/* The invalidations would come as arrays, indistinguishable
+			* from replies */
+			c->addReplyError("Client tracking requires RESP3, turn it off before HELLO %d",resp);
+			return;
+		}
+		for (; j < c->argc; j++) {
+			int moreargs = c->argc - j - 1;
+			if (c->argv[j].equalsNoCase("auth") && moreargs >= 2) {
+				/* There are no users to authenticate against */
+				c->addReplyError("AUTH called without any password configured for the default user");
+				return;
+			} else if (c->argv[j].equalsNoCase("setname") && moreargs >= 1) {
+				if (!setName(c,c->argv[j+1])) {
+					return;
+				}
+				j++;
+			} else {
+				c->addReplyError("Syntax error in HELLO option '%.*s'",
+					static_cast<int>(c->argv[j].len > 64 ? 64 : c->argv[j].len),c->argv[j].ptr);
+				return;
+			}
+		}
+
+		/* The reply already uses the negotiated protocol */
+		c->reply.setResp(resp);
+		c->reply.addMapLen(7);
+		c->addReplyBulkCString("server");
+		c->addReplyBulkCString("redis");
+		c->addReplyBulkCString("version");
+		c->addReplyBulkCString(REDIS_VERSION);
+		c->addReplyBulkCString("proto");
+		c->addReplyLongLong(resp);
+		c->addReplyBulkCString("id");
+		c->addReplyLongLong(c->id);
+		c->addReplyBulkCString("mode");
+		c->addReplyBulkCString("standalone");
+		c->addReplyBulkCString("role");
+		c->addReplyBulkCString("master");
+		c->addReplyBulkCString("modules");
+		c->addReply(REPLY_EMPTY_ARRAY,sizeof(REPLY_EMPTY_ARRAY)-1);
+	}
+
+	/* CLIENT TRACKING on|off [BCAST] [PREFIX prefix ...] [NOLOOP] */
+	void clientTrackingCommand(Client* c){
+		TrackingTable& tracking = c->manager->getTracking();
+		if (c->argc < 3) {
+			c->addReply(REPLY_SYNTAX_ERR,sizeof(REPLY_SYNTAX_ERR)-1);
+			return;
+		}
+		if (c->argv[2].equalsNoCase("off")) {
+			if (c->argc != 3) {
+				c->addReply(REPLY_SYNTAX_ERR,sizeof(REPLY_SYNTAX_ERR)-1);
+				return;
+			}
+			tracking.disable(c);
+			c->addReply(REPLY_OK,sizeof(REPLY_OK)-1);
+			return;
+		}
+		if (!c->argv[2].equalsNoCase("on")) {
+			c->addReply(REPLY_SYNTAX_ERR,sizeof(REPLY_SYNTAX_ERR)-1);
+			return;
+		}
+
+		int bcast = 0, noloop = 0;
+		std::vector<sds_t> prefixes;
+		for (int j = 3; j < c->argc; j++) {
+			int moreargs = c->argc - j - 1;
+			if (c->argv[j].equalsNoCase("bcast")) {
+				bcast = 1;
+			} else if (c->argv[j].equalsNoCase("noloop")) {
+				noloop = 1;
+			} else if (c->argv[j].equalsNoCase("prefix") && moreargs) {
+				j++;
+				prefixes.push_back(c->argv[j].toSds());
+			} else {
+				c->addReply(REPLY_SYNTAX_ERR,sizeof(REPLY_SYNTAX_ERR)-1);
+				return;
+			}
+		}
+		if (!bcast && !prefixes.empty()) {
+			c->addReplyError("PREFIX option requires BCAST mode to be enabled");
+			return;
+		}
+		/* There is no REDIRECT: the invalidations are pushes on the
+		* connection itself, which only RESP3 can interleave with replies */
+		if (c->reply.getResp() != 3) {
+			c->addReplyError("Client tracking requires RESP3, see HELLO 3");
+			return;
+		}
+		tracking.enable(c,bcast,prefixes,noloop);
+		c->addReply(REPLY_OK,sizeof(REPLY_OK)-1);
+	}
+
+	void clientCommand(Client* c){
+		const ArgView& sub = c->argv[1];
+		if (sub.equalsNoCase("id") && c->argc == 2) {
+			c->addReplyLongLong(c->id);
+		} else if (sub.equalsNoCase("getname") && c->argc == 2) {
+			if (c->name[0]) {
+				c->addReplyBulkCString(c->name);
+			} else {
+				c->reply.addNull();
+			}
+		} else if (sub.equalsNoCase("setname") && c->argc == 3) {
+			if (setName(c,c->argv[2])) {
+				c->addReply(REPLY_OK,sizeof(REPLY_OK)-1);
+			}
+		} else if (sub.equalsNoCase("tracking")) {
+			clientTrackingCommand(c);
+		} else {
+			c->addReplyError("Unknown subcommand or wrong number of arguments for '%.*s'",
+				static_cast<int>(sub.len > 64 ? 64 : sub.len),sub.ptr);
+		}
+	}
+
+	/* Sorted by name */
+	const Command builtinCommands[] = {
+		{"client",clientCommand,-2,0,0,0,0},
+		{"echo",echoCommand,2,0,0,0,0},
+		{"hello",helloCommand,-1,0,0,0,0},
+		{"ping",pingCommand,-1,0,0,0,0}
+	};
+}
+
+Client::Client(ClientManager* manager, EventLoop* eventLoop, int fd, long long id,
+	ReplyBlockPool* pool)
+:id(id),
+fd(fd),
+flags(0),
+eventLoop(eventLoop),
+manager(manager),
+querybuf(NULL),
+qblen(0),
+qbcap(0),
+reply(pool),
+argc(0),
+argv(NULL)
+{
+	this->name[0] = '\0';
+}
+
+Client::~Client(){
+	zfree(this->querybuf);
+}
+
+void Client::addReplyStatus(const char* status){
+	this->reply.addStatic("+",1);
+	this->reply.addCopy(status,strlen(status));
+	this->reply.addStatic("\r\n",2);
+}
+
+/* The message may not contain newlines: they are turned into spaces. A
+* message starting with '-' carries its own error code. */
+void Client::addReplyError(const char* fmt, ...){
+	char msg[ERR_MSG_LEN];
+	va_list ap;
+	va_start(ap,fmt);
+	int len = vsnprintf(msg,sizeof(msg),fmt,ap);
+	va_end(ap);
+	if (len < 0) {
+		len = 0;
+	} else if (len >= static_cast<int>(sizeof(msg))) {
+		len = sizeof(msg) - 1;
+	}
+	for (int j = 0; j < len; j++) {
+		if (msg[j] == '\r' || msg[j] == '\n') {
+			msg[j] = ' ';
+		}
+	}
+	if (len == 0 || msg[0] != '-') {
+		this->reply.addStatic("-ERR ",5);
+	}
+	this->reply.addCopy(msg,len);
+	this->reply.addStatic("\r\n",2);
+}
+
+void Client::addReplyBulkCString(const char* s){
+	this->reply.addBulk(s,s ? strlen(s) : 0,NULL);
+}
+
+/* Install the write handler, once, for the replies queued so far */
+void Client::flushLater(){
+	if ((this->flags & CLIENT_PENDING_WRITE) || this->reply.empty()) {
+		return;
+	}
+	if (this->eventLoop->createFileEvent(this->fd,AE_WRITABLE,
+		ClientManager::sendReplyToClient,this) == AE_ERR)
+	{
+		redisLog(REDIS_WARNING,"Installing the write handler of client %lld: %s",
+			this->id,strerror(errno));
+		return;
+	}
+	this->flags |= CLIENT_PENDING_WRITE;
+}
+
+void ClientStats::reset(){
+	this->immediateWrites = this->deferredWrites = 0;
+	this->pipelineDepth.reset();
+	this->writeBytes.reset();
+}
+
+ClientManager::ClientManager()
+:nextId(1),
+tracking(this),
+numCommands(0)
+{
+	for (size_t i = 0; i < sizeof(builtinCommands)/sizeof(builtinCommands[0]); ++ i) {
+		this->addCommand(&builtinCommands[i]);
+	}
+}
+
+ClientManager::~ClientManager(){
+	while (!this->clients.empty()) {
+		this->freeClient(this->clients.begin()->second);
+	}
+	this->tracking.detach();
+	this->autoCork.detach();
+}
+
+void ClientManager::onAccept(EventLoop* eventLoop, int fd, const char* ip, int port){
+	if (this->registerClient(eventLoop,fd) == NULL) {
+		redisLog(REDIS_WARNING,"Error registering fd event for the new client %s:%d: %s",
+			ip,port,strerror(errno));
+		close(fd);
+	}
+}
+
+/* Serve 'fd' on 'eventLoop', a socket that did not come through the
+* accept path of a ReactorGroup. Returns NULL if it cannot be registered,
+* the caller still owns the descriptor then. */
+Client* ClientManager::createClient(EventLoop* eventLoop, int fd){
+	char err[ANET_ERR_LEN];
+	if (anetNonBlock(err,fd) == ANET_ERR) {
+		return NULL;
+	}
+	anetEnableTcpNoDelay(err,fd);
+	return this->registerClient(eventLoop,fd);
+}
+
+/* A socket already non blocking, with its options set */
+Client* ClientManager::registerClient(EventLoop* eventLoop, int fd){
+	Client* c = new Client(this,eventLoop,fd,this->nextId,&this->pool);
+	c->reply.setWriteStats(&this->stats.writeBytes);
+	c->reply.setAutoCork(&this->autoCork);
+	if (eventLoop->createFileEvent(fd,AE_READABLE|AE_ERRQUEUE,readQueryFromClient,c) == AE_ERR) {
+		delete c;
+		return NULL;
+	}
+	if (!this->tracking.attached()) {
+		this->tracking.attach(eventLoop);
+	}
+	if (!this->autoCork.attached()) {
+		this->autoCork.attach(eventLoop);
+	}
+	this->nextId ++;
+	this->clients[c->id] = c;
+	return c;
+}
+
+void ClientManager::freeClient(Client* c){
+	if (c->flags & CLIENT_TRACKING) {
+		this->tracking.disable(c);
+	}
+	c->eventLoop->deleteFileEvent(c->fd,AE_READABLE|AE_WRITABLE);
+	/* The fd number may be reused before the before sleep hook runs */
+	this->autoCork.forget(c->fd);
+	if (c->reply.zerocopyInflight()) {
+		/* The kernel may still read the replies: keep them pinned */
+		this->reaper.adopt(c->eventLoop,c->fd,&c->reply);
+	} else {
+		close(c->fd);
+	}
+	this->clients.erase(c->id);
+	delete c;
+}
+
+Client* ClientManager::lookupClient(long long id) const{
+	ClientMap_t::const_iterator it = this->clients.find(id);
+	return it == this->clients.end() ? NULL : it->second;
+}
+
+/* Write the batching statistics to 'buf' as INFO fields, returning the
+* length the full text needs like EventLoop::getLoopStatsInfo() */
+size_t ClientManager::getStatsInfo(char* buf, size_t len) const{
+	const ClientStats& st = this->stats;
+	const LatencyHistogram& depth = st.pipelineDepth;
+	const LatencyHistogram& writes = st.writeBytes;
+	int n = snprintf(buf,len,
+		"# Clients\r\n"
+		"connected_clients:%zu\r\n"
+		"total_commands_processed:%lld\r\n"
+		"pipeline_depth_avg:%.2f\r\n"
+		"bytes_per_write_avg:%.2f\r\n"
+		"immediate_writes:%lld\r\n"
+		"deferred_writes:%lld\r\n",
+		this->clients.size(),this->numCommands,
+		depth.count ? static_cast<double>(depth.sum) / depth.count : 0.0,
+		writes.count ? static_cast<double>(writes.sum) / writes.count : 0.0,
+		st.immediateWrites,st.deferredWrites);
+	size_t pos = n < 0 ? 0 : n;
+	pos = depth.catInfo(buf,len,pos,"pipeline_depth");
+	pos = writes.catInfo(buf,len,pos,"write_bytes");
+	return pos;
+}
+
+void ClientManager::addCommand(const Command* cmd){
+	CommandVector_t::iterator it = this->commands.begin();
+	while (it != this->commands.end() && strcasecmp((*it)->name,cmd->name) < 0) {
+		++ it;
+	}
+	if (it != this->commands.end() && strcasecmp((*it)->name,cmd->name) == 0) {
+		*it = cmd;
+	} else {
+		this->commands.insert(it,cmd);
+	}
+}
+
+/* Binary search on the name as it is in the read buffer, no copy */
+const Command* ClientManager::lookupCommand(const ArgView& name) const{
+	if (name.len >= CMD_NAME_LEN) {
+		return NULL;
+	}
+	size_t lo = 0, hi = this->commands.size();
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		const char* cmdname = this->commands[mid]->name;
+		/* The argument may hold NULs: compare no further than the name */
+		size_t cmdlen = strlen(cmdname);
+		int cmp = strncasecmp(cmdname,name.ptr,cmdlen < name.len ? cmdlen : name.len);
+		if (cmp == 0 && cmdlen != name.len) {
+			cmp = cmdlen < name.len ? -1 : 1;
+		}
+		if (cmp == 0) {
+			return this->commands[mid];
+		} else if (cmp < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return NULL;
+}
+
+/* Run every complete command of the query buffer, then drop their bytes.
+* The replies pile up in the chain: the caller sends them all at once.
+* It stops at PROTO_REPLY_BACKLOG bytes of output, the rest of the
+* pipeline waits for the client to read. Returns the number of commands
+* run. */
+long long ClientManager::processInput(Client* c){
+	long long commands = 0;
+	while (!(c->flags & CLIENT_CLOSE_AFTER_REPLY) && c->reply.size() < PROTO_REPLY_BACKLOG) {
+		int retval = c->parser.parse(c->querybuf,c->qblen);
+		if (retval == REQ_MORE) {
+			break;
+		}
+		if (retval == REQ_ERR) {
+			c->addReplyError("Protocol error: %s",c->parser.getError());
+			c->flags |= CLIENT_CLOSE_AFTER_REPLY;
+			break;
+		}
+		c->argc = c->parser.argc();
+		c->argv = c->parser.argv();
+		if (c->argc > 0) {
+			this->processCommand(c);
+			commands ++;
+		}
+	}
+	c->argc = 0;
+	c->argv = NULL;
+	if (commands) {
+		this->stats.pipelineDepth.add(commands);
+	}
+
+	size_t parsed = c->parser.parsed();
+	if (parsed > 0) {
+		memmove(c->querybuf,c->querybuf+parsed,c->qblen-parsed);
+		c->qblen -= parsed;
+		c->parser.discard(parsed);
+	}
+	return commands;
+}
+
+int ClientManager::processCommand(Client* c){
+	const Command* cmd = this->lookupCommand(c->argv[0]);
+	if (cmd == NULL) {
+		c->addReplyError("unknown command '%.*s'",
+			static_cast<int>(c->argv[0].len > 128 ? 128 : c->argv[0].len),c->argv[0].ptr);
+		return AE_ERR;
+	}
+	if ((cmd->arity > 0 && cmd->arity != c->argc) || c->argc < -cmd->arity) {
+		c->addReplyError("wrong number of arguments for '%s' command",cmd->name);
+		return AE_ERR;
+	}
+
+	/* Keys are remembered before the command runs: a read that races with
+	* its own invalidation gets the push after the reply */
+	if ((cmd->flags & CMD_READONLY) && cmd->firstkey &&
+		(c->flags & (CLIENT_TRACKING|CLIENT_TRACKING_BCAST)) == CLIENT_TRACKING)
+	{
+		int last = cmd->lastkey < 0 ? c->argc + cmd->lastkey : cmd->lastkey;
+		for (int j = cmd->firstkey; j <= last && j < c->argc; j += cmd->keystep) {
+			this->tracking.rememberKey(c,c->argv[j].ptr,c->argv[j].len);
+		}
+	}
+	cmd->proc(c);
+	this->numCommands ++;
+	return AE_OK;
+}
+
+void ClientManager::readQueryFromClient(EventLoop* eventLoop, int fd, void* clientData, int mask){
+	Client* c = reinterpret_cast<Client*>(clientData);
+	ClientManager* manager = c->manager;
+	/* Zero copy completions: the read below then just finds EAGAIN */
+	if (mask & AE_ERRQUEUE) {
+		c->reply.reapZeroCopy(fd);
+	}
+
+	/* Read until EAGAIN, as AE_EDGE and the io_uring backend only report
+	* new data, or until the handler budget runs out: the loop then calls
+	* back next iteration. The commands a backlog left in the buffer go
+	* first. */
+	size_t bytes = 0;
+	long long commands = manager->processInput(c);
+	while (!(c->flags & CLIENT_CLOSE_AFTER_REPLY) && c->reply.size() < PROTO_REPLY_BACKLOG) {
+		/* Read a big argument at once rather than in PROTO_IOBUF_LEN slices.
+		* The length comes from the client: the buffer grows at most
+		* PROTO_LOOKAHEAD_LEN, or its own size, past the data it holds, so
+		* a header alone can't allocate the whole argument. */
+		size_t readlen = c->parser.wanted(c->qblen);
+		size_t lookahead = c->qblen > PROTO_LOOKAHEAD_LEN ? c->qblen : PROTO_LOOKAHEAD_LEN;
+		if (readlen > lookahead) {
+			readlen = lookahead;
+		}
+		if (readlen < PROTO_IOBUF_LEN) {
+			readlen = PROTO_IOBUF_LEN;
+		}
+		if (c->qbcap - c->qblen < readlen) {
+			c->qbcap = c->qblen + readlen;
+			c->querybuf = reinterpret_cast<char*>(zrealloc(c->querybuf,c->qbcap));
+		}
+		ssize_t nread = read(fd,c->querybuf+c->qblen,readlen);
+		if (nread == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN) {
+				break;
+			}
+			redisLog(REDIS_VERBOSE,"Reading from client %lld: %s",c->id,strerror(errno));
+			manager->freeClient(c);
+			return;
+		} else if (nread == 0) {
+			redisLog(REDIS_VERBOSE,"Client %lld closed connection",c->id);
+			manager->freeClient(c);
+			return;
+		}
+		c->qblen += nread;
+		if (c->qblen > PROTO_MAX_QUERYBUF) {
+			redisLog(REDIS_WARNING,"Closing client %lld that reached max query buffer length",c->id);
+			manager->freeClient(c);
+			return;
+		}
+		bytes += nread;
+		commands += manager->processInput(c);
+		if (eventLoop->overBudget(bytes,static_cast<long>(commands))) {
+			eventLoop->yield(fd,AE_READABLE);
+			break;
+		}
+	}
+
+	/* One write for the whole batch. If the write handler is already
+	* installed the socket was full: the replies wait behind the others. */
+	int backlog = c->reply.size() >= PROTO_REPLY_BACKLOG;
+	if (!(c->flags & CLIENT_PENDING_WRITE) && !c->reply.empty()) {
+		if (manager->writeToClient(c) == AE_ERR) {
+			return;
+		}
+		if (c->flags & CLIENT_PENDING_WRITE) {
+			manager->stats.deferredWrites ++;
+		} else {
+			manager->stats.immediateWrites ++;
+		}
+	}
+	if (backlog && !(c->flags & CLIENT_CLOSE_AFTER_REPLY)) {
+		if (c->flags & CLIENT_PENDING_WRITE) {
+			/* A client that doesn't read its replies: stop reading its
+			* requests until the write handler drains the output */
+			eventLoop->deleteFileEvent(fd,AE_READABLE);
+			c->flags |= CLIENT_READ_PAUSED;
+		} else {
+			eventLoop->yield(fd,AE_READABLE);
+		}
+	}
+}
+
+/* Write what the socket takes, and leave the rest to the write handler.
+* Returns AE_ERR if the client was freed. */
+int ClientManager::writeToClient(Client* c){
+	ssize_t nwritten = c->reply.writeTo(c->fd);
+	if (nwritten == -1 && errno != EAGAIN) {
+		redisLog(REDIS_VERBOSE,"Error writing to client %lld: %s",c->id,strerror(errno));
+		this->freeClient(c);
+		return AE_ERR;
+	}
+	if ((c->flags & CLIENT_READ_PAUSED) && c->reply.size() < PROTO_REPLY_BACKLOG) {
+		if (c->eventLoop->createFileEvent(c->fd,AE_READABLE,readQueryFromClient,c) == AE_ERR) {
+			redisLog(REDIS_WARNING,"Resuming the reads of client %lld: %s",c->id,strerror(errno));
+			this->freeClient(c);
+			return AE_ERR;
+		}
+		c->flags &= ~CLIENT_READ_PAUSED;
+		/* The rest of the pipeline is buffered, or already reported */
+		c->eventLoop->yield(c->fd,AE_READABLE);
+	}
+	if (!c->reply.empty()) {
+		c->flushLater();
+		return AE_OK;
+	}
+	if (c->flags & CLIENT_PENDING_WRITE) {
+		c->eventLoop->deleteFileEvent(c->fd,AE_WRITABLE);
+		c->flags &= ~CLIENT_PENDING_WRITE;
+	}
+	if (c->flags & CLIENT_CLOSE_AFTER_REPLY) {
+		this->freeClient(c);
+		return AE_ERR;
+	}
+	return AE_OK;
+}
+
+void ClientManager::sendReplyToClient(EventLoop* eventLoop, int fd, void* clientData, int mask){
+	Client* c = reinterpret_cast<Client*>(clientData);
+	/* Completions of a paused client, which has no read handler */
+	if (mask & AE_ERRQUEUE) {
+		c->reply.reapZeroCopy(fd);
+	}
+	c->manager->writeToClient(c);
+}
+
+}
@@ -0,0 +1,167 @@
+/************************************************************************/
+/*                                                                      */
+/************************************************************************/
+#ifndef _REDIS_REDISCPP_NETWORKING_H_
+#define _REDIS_REDISCPP_NETWORKING_H_
+
+#include "ae.h"
+#include "reactor.h"
+#include "reply.h"
+#include "request.h"
+#include "structs.h"
+#include "tracking.h"
+
+#include <map>
+#include <vector>
+
+namespace redis{
+
+	enum {
+		/* Client flags */
+		CLIENT_TRACKING = (1<<0),        /* CLIENT TRACKING is on */
+		CLIENT_TRACKING_BCAST = (1<<1),  /* ... in broadcast mode */
+		CLIENT_TRACKING_NOLOOP = (1<<2), /* not about its own writes */
+		CLIENT_PENDING_WRITE = (1<<3),   /* the write handler is installed */
+		CLIENT_CLOSE_AFTER_REPLY = (1<<4),
+		CLIENT_READ_PAUSED = (1<<5),     /* output backlog: not reading */
+
+		/* Command flags */
+		CMD_READONLY = (1<<0), /* reads its keys: tracked */
+		CMD_WRITE = (1<<1),
+
+		PROTO_IOBUF_LEN = 16*1024,   /* bytes read per call, at least */
+		PROTO_LOOKAHEAD_LEN = 4*1024*1024, /* growth ahead of the data read */
+		PROTO_MAX_QUERYBUF = 1024*1024*1024,
+		PROTO_REPLY_BACKLOG = 4*1024*1024, /* pending output that stops the reads */
+		CLIENT_NAME_LEN = 64
+	};
+
+	class Client;
+	class ClientManager;
+
+	typedef void CommandProc_t(Client* c);
+
+	/* A command and where its keys are: argv[firstkey] to argv[lastkey]
+	* every keystep arguments, lastkey -1 meaning the last argument. An
+	* arity of -N means N arguments or more. */
+	struct Command{
+		const char* name;
+		CommandProc_t* proc;
+		int arity;
+		int flags;
+		int firstkey;
+		int lastkey;
+		int keystep;
+	};
+
+	/* A connection: its query buffer, parsed in place, and its output */
+	class Client{
+	public:
+		long long id;
+		int fd;
+		int flags;
+		EventLoop* eventLoop;
+		ClientManager* manager;
+		char* querybuf;
+		size_t qblen;
+		size_t qbcap;
+		RequestParser parser;
+		ReplyChain reply;
+		int argc;
+		const ArgView* argv;
+		char name[CLIENT_NAME_LEN];
+
+		Client(ClientManager* manager, EventLoop* eventLoop, int fd, long long id,
+			ReplyBlockPool* pool);
+		~Client();
+
+		void addReply(const char* s, size_t len){
+			this->reply.addStatic(s,len);
+		}
+		void addReplyStatus(const char* status);
+		void addReplyError(const char* fmt, ...);
+		void addReplyLongLong(long long value){
+			this->reply.addLongLong(':',value);
+		}
+		void addReplyBulk(const char* s, size_t len){
+			this->reply.addBulk(s,len,NULL);
+		}
+		void addReplyBulkCString(const char* s);
+		void flushLater();
+	};
+
+	/* How well the replies of a pipeline are batched: the commands run per
+	* read, and the bytes each write() syscall carries */
+	struct ClientStats{
+		long long immediateWrites; /* batches written from the read handler */
+		long long deferredWrites;  /* batches left to the write handler */
+		LatencyHistogram pipelineDepth;
+		LatencyHistogram writeBytes;
+		ClientStats()
+			:immediateWrites(0),deferredWrites(0)
+		{}
+		void reset();
+	};
+
+	typedef std::map<long long, Client*> ClientMap_t;
+	typedef std::vector<const Command*> CommandVector_t; /* sorted by name */
+
+	/* Owns the connections of one event loop and runs their commands. A
+	* read event runs every complete command it receives as one batch,
+	* and its replies leave in a single write, or a single installation of
+	* the write handler when the socket is full. The sockets written to
+	* stay corked until the loop goes to sleep. The client table and the
+	* tracking table are not locked: a ReactorGroup serving through a
+	* ClientManager must run a single reactor. */
+	class ClientManager : public AcceptHandler{
+		ClientMap_t clients;
+		CommandVector_t commands;
+		long long nextId;
+		ReplyBlockPool pool;
+		ReplyReaper reaper; /* after the pool: it releases blocks to it */
+		TrackingTable tracking;
+		AutoCork autoCork; /* the replies of an iteration leave in full frames */
+
+		Client* registerClient(EventLoop* eventLoop, int fd);
+		long long processInput(Client* c);
+		int processCommand(Client* c);
+		int writeToClient(Client* c);
+	public:
+		long long numCommands;
+		ClientStats stats;
+
+		ClientManager();
+		virtual ~ClientManager();
+
+		/* The sockets of a ReactorGroup come configured by its accept
+		* options: set them up with acceptOptions() before start() */
+		virtual void onAccept(EventLoop* eventLoop, int fd, const char* ip, int port);
+		static void acceptOptions(AnetAcceptOptions* opts){
+			opts->nodelay = 1;
+		}
+		Client* createClient(EventLoop* eventLoop, int fd);
+		void freeClient(Client* c);
+		Client* lookupClient(long long id) const;
+		size_t size() const{
+			return this->clients.size();
+		}
+
+		void addCommand(const Command* cmd);
+		const Command* lookupCommand(const ArgView& name) const;
+
+		size_t getStatsInfo(char* buf, size_t len) const;
+
+		TrackingTable& getTracking(){
+			return this->tracking;
+		}
+		/* Called by the write commands for every key they change */
+		void signalModifiedKey(const char* key, size_t len, Client* by){
+			this->tracking.invalidateKey(key,len,by);
+		}
+
+		static void readQueryFromClient(EventLoop* eventLoop, int fd, void* clientData, int mask);
+		static void sendReplyToClient(EventLoop* eventLoop, int fd, void* clientData, int mask);
+	};
+}
+
+#endif // _REDIS_REDISCPP_NETWORKING_H_
@@ -0,0 +1,76 @@
+/************************************************************************/
+/*                                                                      */
+/************************************************************************/
+#include "proto.h"
+#include "util.h"
+
+#include <string.h>
+
+namespace redis{ namespace{
+	enum {
+		PROTO_ENTRY_BYTES = 8 /* "$1023\r\n" and its length fit */
+	};
+
+	const char PROTO_PREFIXES[] = "*$:";
+
+	/* PROTO_SHARED_HEADERS headers per prefix, one fixed size entry each so
+	* that copying one is a single 8 bytes move. The last byte of an entry
+	* holds its length. */
+	struct ProtoHeaderTable{
+		char entries[sizeof(PROTO_PREFIXES)-1][PROTO_SHARED_HEADERS][PROTO_ENTRY_BYTES];
+
+		ProtoHeaderTable(){
+			for (size_t p = 0; p < sizeof(PROTO_PREFIXES)-1; ++ p) {
+				for (int count = 0; count < PROTO_SHARED_HEADERS; ++ count) {
+					char* entry = this->entries[p][count];
+					entry[0] = PROTO_PREFIXES[p];
+					int len = 1 + ll2string(entry+1,PROTO_ENTRY_BYTES-1,count);
+					entry[len++] = '\r';
+					entry[len++] = '\n';
+					entry[PROTO_ENTRY_BYTES-1] = static_cast<char>(len);
+				}
+			}
+		}
+	};
+
+	const ProtoHeaderTable protoHeaders;
+
+	inline const char* protoEntry(char prefix, long long count){
+		if (count < 0 || count >= PROTO_SHARED_HEADERS) {
+			return NULL;
+		}
+		switch (prefix) {
+		case '*': return protoHeaders.entries[0][count];
+		case '$': return protoHeaders.entries[1][count];
+		case ':': return protoHeaders.entries[2][count];
+		default: return NULL;
+		}
+	}
+}
+
+/* Write "<prefix><count>\r\n" to 'buf', which must have PROTO_HEADER_MAX
+* bytes of room, and return its length. */
+size_t protoHeader(char* buf, char prefix, long long count){
+	const char* entry = protoEntry(prefix,count);
+	if (entry) {
+		memcpy(buf,entry,PROTO_ENTRY_BYTES);
+		return static_cast<unsigned char>(entry[PROTO_ENTRY_BYTES-1]);
+	}
+	buf[0] = prefix;
+	size_t len = 1 + ll2string(buf+1,PROTO_HEADER_MAX-3,static_cast<long>(count));
+	buf[len++] = '\r';
+	buf[len++] = '\n';
+	return len;
+}
+
+/* The precomputed "<prefix><count>\r\n", which lives as long as the
+* program and can be sent in place, or NULL if there is none. */
+const char* protoSharedHeader(char prefix, long long count, size_t* len){
+	const char* entry = protoEntry(prefix,count);
+	if (entry) {
+		*len = static_cast<unsigned char>(entry[PROTO_ENTRY_BYTES-1]);
+	}
+	return entry;
+}
+
+}
@@ -0,0 +1,24 @@
+/************************************************************************/
+/*                                                                      */
+/************************************************************************/
+#ifndef _REDIS_REDISCPP_PROTO_H_
+#define _REDIS_REDISCPP_PROTO_H_
+
+#include <stddef.h>
+
+namespace redis{
+
+	enum {
+		PROTO_HEADER_MAX = 32,   /* room protoHeader() may write to */
+		PROTO_SHARED_HEADERS = 1024 /* counts with a precomputed header */
+	};
+
+	/* Protocol formatting shared by the network replies and the RIO
+	* writers of the AOF. The headers "*<count>\r\n", "$<count>\r\n" and
+	* ":<count>\r\n" of the small counts, the bulk of an LRANGE or an
+	* HGETALL reply, come from a precomputed table. */
+	size_t protoHeader(char* buf, char prefix, long long count);
+	const char* protoSharedHeader(char prefix, long long count, size_t* len);
+}
+
+#endif // _REDIS_REDISCPP_PROTO_H_
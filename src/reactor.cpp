@@ -0,0 +1,230 @@
+/************************************************************************/
+/*                                                                      */
+/************************************************************************/
+#include "fmacros.h"
+#include "reactor.h"
+#include "anet.h"
+#include "config.h"
+#include "consts.h"
+#include "log.h"
+#include "zmalloc.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace redis{ namespace{
+	enum {
+		REACTOR_ACCEPT_BATCH = 64,
+		REACTOR_MAX_ACCEPTS_PER_CALL = 1024
+	};
+
+	/* Accepts from the reactor's listener until it would block, a batch of
+	* connections per syscall loop */
+	void reactorAccept(EventLoop* eventLoop, int fd, void* clientData, int mask){
+		Reactor* reactor = reinterpret_cast<Reactor*>(clientData);
+		ReactorGroup* group = reactor->group;
+		char err[ANET_ERR_LEN];
+		AnetPeer peers[REACTOR_ACCEPT_BATCH];
+		for (int max = REACTOR_MAX_ACCEPTS_PER_CALL; max > 0; max -= REACTOR_ACCEPT_BATCH) {
+			int count = anetTcpAcceptBatch(err,fd,peers,REACTOR_ACCEPT_BATCH,
+				&group->getAcceptOptions());
+			if (count == ANET_ERR) {
+				redisLog(REDIS_WARNING,"Accepting client connection: %s", err);
+				return;
+			}
+			for (int i = 0; i < count; ++ i) {
+				group->getHandler()->onAccept(eventLoop,peers[i].fd,peers[i].ip,peers[i].port);
+			}
+			if (count < REACTOR_ACCEPT_BATCH) {
+				return;
+			}
+		}
+	}
+
+	struct ReactorStop : public LoopTask{
+		virtual void run(EventLoop* eventLoop){
+			eventLoop->stop();
+		}
+	};
+
+	void* reactorMain(void* arg){
+		Reactor* reactor = reinterpret_cast<Reactor*>(arg);
+#ifdef HAVE_PTHREAD_AFFINITY
+		if (reactor->cpu != -1) {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(reactor->cpu,&set);
+			int retval = pthread_setaffinity_np(pthread_self(),sizeof(set),&set);
+			if (retval != 0) {
+				redisLog(REDIS_WARNING,"Pinning reactor %d to CPU %d: %s",
+					reactor->index,reactor->cpu,strerror(retval));
+			}
+		}
+#endif
+		reactor->loop.main();
+		return NULL;
+	}
+}
+
+ReactorGroup::ReactorGroup(AcceptHandler* handler)
+:handler(handler),
+stopping(0),
+busyPollUs(0),
+shared(0),
+sharedfd(-1),
+cpuMode(REACTOR_CPU_NONE)
+{}
+
+ReactorGroup::~ReactorGroup(){
+	this->stop();
+}
+
+/* Create 'threads' reactors listening on 'port' and start their threads.
+* On error the reactors already started are stopped, and AE_ERR is
+* returned with the reason in 'err' (ANET_ERR_LEN bytes). */
+int ReactorGroup::start(char* err, int threads, int port, char* bindaddr, int setsize){
+	/* The reactors allocate concurrently from now on */
+	zmalloc_enable_thread_safeness();
+	this->stopping = 0;
+
+	std::vector<int> fds(threads,-1);
+	if (this->shared) {
+		this->sharedfd = anetTcpServer(err,port,bindaddr);
+		if (this->sharedfd == ANET_ERR || anetNonBlock(err,this->sharedfd) == ANET_ERR) {
+			this->stop();
+			return AE_ERR;
+		}
+		fds.assign(threads,this->sharedfd);
+	} else if (threads > 0 &&
+		anetTcpReusePortGroup(err,port,bindaddr,&fds[0],threads) == ANET_ERR)
+	{
+		this->stop();
+		return AE_ERR;
+	}
+	/* The reactors own their listener from now on, stop() closes them */
+	for (int i = 0; i < threads; ++ i) {
+		Reactor* reactor = new Reactor(this,i);
+		reactor->listenfd = fds[i];
+		this->reactors.push_back(reactor);
+	}
+	this->setupCpuAffinity();
+
+	for (int i = 0; i < threads; ++ i) {
+		Reactor* reactor = this->reactors[i];
+		if (reactor->loop.init(setsize) == AE_ERR) {
+			snprintf(err,ANET_ERR_LEN,"creating event loop: %s",strerror(errno));
+			this->stop();
+			return AE_ERR;
+		}
+		reactor->loop.setBusyPoll(this->busyPollUs);
+		if ((!this->shared || i == 0) &&
+			anetSetListenOptions(err,reactor->listenfd,&this->listenOptions) == ANET_ERR)
+		{
+			/* Only an optimization: the listener works without it */
+			redisLog(REDIS_WARNING,"Reactor %d listener: %s",i,err);
+		}
+		int mask = AE_READABLE;
+		if (this->shared) {
+			mask |= AE_EXCLUSIVE;
+		} else if (anetNonBlock(err,reactor->listenfd) == ANET_ERR) {
+			this->stop();
+			return AE_ERR;
+		}
+		if (reactor->loop.createFileEvent(reactor->listenfd,mask,reactorAccept,reactor) == AE_ERR) {
+			snprintf(err,ANET_ERR_LEN,"registering listener: %s",strerror(errno));
+			this->stop();
+			return AE_ERR;
+		}
+	}
+
+	for (size_t i = 0; i < this->reactors.size(); ++ i) {
+		Reactor* reactor = this->reactors[i];
+		int retval = pthread_create(&reactor->thread,NULL,reactorMain,reactor);
+		if (retval != 0) {
+			snprintf(err,ANET_ERR_LEN,"creating reactor thread: %s",strerror(retval));
+			this->stop();
+			return AE_ERR;
+		}
+		reactor->started = 1;
+	}
+	return AE_OK;
+}
+
+/* Assign the CPUs to the reactors and tie the listeners to them. The
+* steering is an optimization: if the kernel refuses it, connections are
+* still spread by hash, so it is only logged. */
+void ReactorGroup::setupCpuAffinity(){
+	if (this->cpuMode == REACTOR_CPU_NONE) {
+		return;
+	}
+	std::vector<int> cpus(this->reactors.size());
+	for (size_t i = 0; i < this->reactors.size(); ++ i) {
+		Reactor* reactor = this->reactors[i];
+		reactor->cpu = this->cpus.empty() ? static_cast<int>(i) :
+			this->cpus[i % this->cpus.size()];
+		cpus[i] = reactor->cpu;
+	}
+	if (this->shared || cpus.empty()) {
+		return;
+	}
+
+	char err[ANET_ERR_LEN];
+	if (this->cpuMode == REACTOR_CPU_INCOMING) {
+		for (size_t i = 0; i < this->reactors.size(); ++ i) {
+			Reactor* reactor = this->reactors[i];
+			if (anetSetIncomingCpu(err,reactor->listenfd,reactor->cpu) == ANET_ERR) {
+				redisLog(REDIS_WARNING,"Reactor %d listener: %s",reactor->index,err);
+			}
+		}
+	} else if (this->cpuMode == REACTOR_CPU_STEER) {
+		/* The program belongs to the reuseport group: any listener will do */
+		if (anetReusePortSteerByCpu(err,this->reactors[0]->listenfd,
+			&cpus[0],static_cast<int>(cpus.size())) == ANET_ERR)
+		{
+			redisLog(REDIS_WARNING,"Reactor listeners: %s",err);
+		}
+	}
+}
+
+/* Stop every reactor, wait for its thread and release it. Called from a
+* reactor thread, by a command handler say, the loops are only asked to
+* stop and AE_ERR is returned with errno set to EDEADLK: the joins are
+* left to another call of stop(), or the destructor, from the owner of
+* the group. */
+int ReactorGroup::stop(){
+	this->stopping = 1;
+	int inReactor = 0;
+	for (size_t i = 0; i < this->reactors.size(); ++ i) {
+		Reactor* reactor = this->reactors[i];
+		if (reactor->started) {
+			reactor->loop.post(new ReactorStop());
+			if (pthread_equal(reactor->thread,pthread_self())) {
+				inReactor = 1;
+			}
+		}
+	}
+	if (inReactor) {
+		errno = EDEADLK;
+		return AE_ERR;
+	}
+	for (size_t i = 0; i < this->reactors.size(); ++ i) {
+		Reactor* reactor = this->reactors[i];
+		if (reactor->started) {
+			pthread_join(reactor->thread,NULL);
+		}
+		if (reactor->listenfd != -1 && reactor->listenfd != this->sharedfd) {
+			close(reactor->listenfd);
+		}
+		delete reactor;
+	}
+	this->reactors.clear();
+	if (this->sharedfd != -1) {
+		close(this->sharedfd);
+		this->sharedfd = -1;
+	}
+	return AE_OK;
+}
+
+}
@@ -0,0 +1,132 @@
+/************************************************************************/
+/*                                                                      */
+/************************************************************************/
+#ifndef _REDIS_REDISCPP_REACTOR_H_
+#define _REDIS_REDISCPP_REACTOR_H_
+
+#include "ae.h"
+#include "anet.h"
+
+#include <pthread.h>
+#include <vector>
+
+namespace redis{
+
+	enum {
+		/* How ReactorGroup::setCpuAffinity() ties reactors to CPUs */
+		REACTOR_CPU_NONE = 0,     /* threads float, connections are hashed */
+		REACTOR_CPU_PIN = 1,      /* pin each thread to its CPU */
+		REACTOR_CPU_INCOMING = 2, /* pin, and SO_INCOMING_CPU on its listener */
+		REACTOR_CPU_STEER = 3     /* pin, and a BPF program steering by CPU */
+	};
+
+	class ReactorGroup;
+
+	/* Receives the connections accepted by a ReactorGroup. onAccept() runs
+	* on the thread of the reactor that accepted the connection, and the
+	* connection should be served by that same event loop. The socket is
+	* already non blocking and close-on-exec, with the group's accept
+	* options set. Handlers that drain their sockets until EAGAIN can
+	* register them with AE_EDGE. */
+	class AcceptHandler{
+	public:
+		virtual ~AcceptHandler(){}
+		virtual void onAccept(EventLoop* eventLoop, int fd, const char* ip, int port) = 0;
+	};
+
+	/* One event loop thread, with its own SO_REUSEPORT listener */
+	struct Reactor{
+		int index;
+		int listenfd;
+		int cpu; /* pinned to, or -1 */
+		int started;
+		pthread_t thread;
+		ReactorGroup* group;
+		EventLoop loop;
+
+		Reactor(ReactorGroup* group, int index)
+			:index(index),listenfd(-1),cpu(-1),started(0),group(group)
+		{}
+	};
+
+	typedef std::vector<Reactor*> ReactorVector_t;
+
+	/* Multi-reactor mode: N event loops, each on its own thread and with its
+	* own listening socket bound to the same port. The kernel spreads the
+	* incoming connections across the listeners, so accepting and serving
+	* connections scales with the number of cores.
+	*
+	* With a shared listener the reactors all wait on one listening socket
+	* instead, registered with AE_EXCLUSIVE so that a connection wakes up a
+	* single reactor: for kernels without SO_REUSEPORT, or to let an idle
+	* reactor take the connections a busy one can't accept right now. */
+	class ReactorGroup{
+		ReactorVector_t reactors;
+		AcceptHandler* handler;
+		volatile int stopping;
+		int busyPollUs;
+		AnetAcceptOptions acceptOptions;
+		AnetListenOptions listenOptions;
+		int shared;
+		int sharedfd;
+		int cpuMode;
+		std::vector<int> cpus;
+
+		void setupCpuAffinity();
+	public:
+		ReactorGroup(AcceptHandler* handler);
+		~ReactorGroup();
+
+		int start(char* err, int threads, int port, char* bindaddr, int setsize);
+		/* Call it from a thread that is not a reactor: a reactor can't
+		* join itself, and from one stop() only asks the loops to stop */
+		int stop();
+		/* Busy poll the reactor loops and the accepted sockets for
+		* 'usecs' microseconds before sleeping. Set it before start(). */
+		void setBusyPoll(int usecs){
+			this->busyPollUs = usecs;
+			this->acceptOptions.busypoll = usecs;
+		}
+		/* Socket options for the accepted connections */
+		void setAcceptOptions(const AnetAcceptOptions& opts){
+			this->acceptOptions = opts;
+		}
+		const AnetAcceptOptions& getAcceptOptions() const{
+			return this->acceptOptions;
+		}
+		/* Socket options for the listeners. Set them before start(). */
+		void setListenOptions(const AnetListenOptions& opts){
+			this->listenOptions = opts;
+		}
+		int getBusyPoll() const{
+			return this->busyPollUs;
+		}
+		/* Run reactor i on cpus[i] (or CPU i if 'cpus' is empty), and with
+		* REACTOR_CPU_INCOMING or REACTOR_CPU_STEER have the kernel hand it
+		* the connections whose packets that CPU receives. Pair it with the
+		* NIC queue interrupts bound one per CPU: a connection then stays on
+		* one core from softirq to reply. Set it before start(). */
+		void setCpuAffinity(int mode, const std::vector<int>& cpus){
+			this->cpuMode = mode;
+			this->cpus = cpus;
+		}
+		/* Use one listener for every reactor. Set it before start(). */
+		void setSharedListener(int shared){
+			this->shared = shared;
+		}
+		int isStopping() const{
+			return this->stopping;
+		}
+		AcceptHandler* getHandler() const{
+			return this->handler;
+		}
+		size_t size() const{
+			return this->reactors.size();
+		}
+		Reactor* getReactor(size_t index) const{
+			return this->reactors[index];
+		}
+	};
+}
+
+#endif // _REDIS_REDISCPP_REACTOR_H_
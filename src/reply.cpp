@@ -0,0 +1,553 @@
+/************************************************************************/
+/*                                                                      */
+/************************************************************************/
+#include "reply.h"
+#include "ae.h"
+#include "anet.h"
+#include "proto.h"
+#include "zmalloc.h"
+
+#include <new>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace redis{
+
+void ReplyChunk::recycle(){
+	if (!this->block) {
+		return; /* an inline buffer, it goes with its chain */
+	}
+	if (this->pool) {
+		this->pool->put(this);
+	} else {
+		ReplyBlockPool::free(this);
+	}
+}
+
+ReplyBlockPool::ReplyBlockPool(size_t max)
+:max(max),
+allocs(0),
+reuses(0)
+{}
+
+ReplyBlockPool::~ReplyBlockPool(){
+	for (size_t i = 0; i < this->blocks.size(); ++ i) {
+		free(this->blocks[i]);
+	}
+}
+
+/* A block and its REPLY_BLOCK_BYTES of storage in one allocation */
+ReplyChunk* ReplyBlockPool::allocate(ReplyBlockPool* pool){
+	void* ptr = zmalloc(sizeof(ReplyChunk) + REPLY_BLOCK_BYTES);
+	char* buf = reinterpret_cast<char*>(ptr) + sizeof(ReplyChunk);
+	return new (ptr) ReplyChunk(buf,REPLY_BLOCK_BYTES,pool,1);
+}
+
+void ReplyBlockPool::free(ReplyChunk* chunk){
+	chunk->~ReplyChunk();
+	zfree(chunk);
+}
+
+ReplyChunk* ReplyBlockPool::get(){
+	if (this->blocks.empty()) {
+		this->allocs ++;
+		return allocate(this);
+	}
+	this->reuses ++;
+	ReplyChunk* chunk = this->blocks.back();
+	this->blocks.pop_back();
+	return chunk;
+}
+
+void ReplyBlockPool::put(ReplyChunk* chunk){
+	if (this->blocks.size() >= this->max) {
+		free(chunk);
+		return;
+	}
+	chunk->reset();
+	this->blocks.push_back(chunk);
+}
+
+namespace{
+	const char REPLY_CRLF[] = "\r\n";
+	const char REPLY_NULL_BULK[] = "$-1\r\n";
+	const char REPLY_NULL[] = "_\r\n";
+
+	void unpin(ReplyZeroCopySend& send){
+		for (size_t i = 0; i < send.pinned.size(); ++ i) {
+			send.pinned[i]->release();
+		}
+		send.pinned.clear();
+	}
+
+	/* Read the MSG_ZEROCOPY completions of 'fd' and unpin the sends of
+	* 'inflight' that are done. 'copied' counts the completions the kernel
+	* copied anyway. Returns the number of sends completed, or -1 on error. */
+	int reapCompletions(int fd, ReplyZeroCopyQueue_t& inflight, int* copied){
+		int completed = 0;
+		uint32_t lo, hi;
+		int wascopied, retval;
+		while ((retval = anetZeroCopyCompletion(fd,&lo,&hi,&wascopied)) == 1) {
+			if (wascopied) {
+				(*copied) ++;
+			}
+			/* Completions come as ranges, not necessarily in order */
+			for (ReplyZeroCopyQueue_t::iterator it = inflight.begin();
+				it != inflight.end(); )
+			{
+				if (it->seq - lo <= hi - lo) {
+					unpin(*it);
+					it = inflight.erase(it);
+					completed ++;
+				} else {
+					++ it;
+				}
+			}
+		}
+		return retval == -1 ? -1 : completed;
+	}
+}
+
+ReplyChain::ReplyChain(ReplyBlockPool* pool)
+:pending(0),
+pool(pool),
+resp(2),
+inlineChunk(inlineBuf,REPLY_INLINE_BYTES,NULL,0),
+autoCork(NULL),
+writeSizes(NULL),
+zerocopyThreshold(0),
+zerocopySeq(0),
+zerocopySends(0),
+zerocopyCopied(0)
+{
+	this->tail = &this->inlineChunk;
+}
+
+/* The sends still in flight belong to a ReplyReaper by now. If they
+* don't, their fragments are leaked rather than released: the kernel may
+* still read them, and a recycled block would go out with other data. */
+ReplyChain::~ReplyChain(){
+	this->clear();
+	if (this->tail != &this->inlineChunk) {
+		this->tail->release();
+	}
+}
+
+/* Append a segment, or grow the last one when 'data' follows it in the
+* same memory. The caller already holds the reference the segment takes. */
+void ReplyChain::push(const char* data, size_t len, ReplyRef* ref){
+	this->pending += len;
+	if (!this->segments.empty()) {
+		ReplySegment& last = this->segments.back();
+		if (last.ref == ref && last.data + last.len == data) {
+			last.len += len;
+			if (ref) {
+				ref->release();
+			}
+			return;
+		}
+	}
+	ReplySegment segment;
+	segment.data = data;
+	segment.len = len;
+	segment.ref = ref;
+	this->segments.push_back(segment);
+}
+
+void ReplyChain::addStatic(const char* data, size_t len){
+	if (len > 0) {
+		this->push(data,len,NULL);
+	}
+}
+
+/* The tail is full: continue in a new block */
+void ReplyChain::grow(){
+	if (this->tail != &this->inlineChunk) {
+		this->tail->release();
+	}
+	this->tail = this->pool ? this->pool->get() : ReplyBlockPool::allocate(NULL);
+}
+
+/* Everything was written: copy to the start of the inline buffer again,
+* unless zero copy is on, or to the start of the tail block unless a zero
+* copy send still reads from it */
+void ReplyChain::rewind(){
+	if (!this->zerocopyThreshold && !this->inlineChunk.shared()) {
+		this->inlineChunk.used = 0;
+		if (this->tail != &this->inlineChunk) {
+			this->tail->release();
+			this->tail = &this->inlineChunk;
+		}
+	} else if (!this->tail->shared()) {
+		this->tail->used = 0;
+	}
+}
+
+void ReplyChain::addCopy(const char* data, size_t len){
+	while (len > 0) {
+		if (this->tail->avail() == 0) {
+			this->grow();
+		}
+		ReplyChunk* chunk = this->tail;
+		size_t count = len < chunk->avail() ? len : chunk->avail();
+		char* dst = chunk->buf + chunk->used;
+		memcpy(dst,data,count);
+		chunk->used += count;
+		chunk->retain();
+		this->push(dst,count,chunk);
+		data += count;
+		len -= count;
+	}
+}
+
+void ReplyChain::addRef(const char* data, size_t len, ReplyRef* ref){
+	if (len > 0) {
+		ref->retain();
+		this->push(data,len,ref);
+	}
+}
+
+/* Append "<prefix><value>\r\n", the header of bulks and multi bulks */
+void ReplyChain::addLongLong(char prefix, long long value){
+	if (this->tail->avail() < PROTO_HEADER_MAX) {
+		char buf[PROTO_HEADER_MAX];
+		this->addCopy(buf,protoHeader(buf,prefix,value));
+		return;
+	}
+	ReplyChunk* chunk = this->tail;
+	char* dst = chunk->buf + chunk->used;
+	size_t len = protoHeader(dst,prefix,value);
+	chunk->used += len;
+	chunk->retain();
+	this->push(dst,len,chunk);
+}
+
+/* Append a bulk reply of 'data', or the null bulk if 'data' is NULL. Short
+* payloads are copied along with the header; longer ones are referenced if
+* the caller passes the 'ref' pinning them. */
+void ReplyChain::addBulk(const char* data, size_t len, ReplyRef* ref){
+	if (data == NULL) {
+		this->addStatic(REPLY_NULL_BULK,sizeof(REPLY_NULL_BULK)-1);
+		return;
+	}
+	this->addLongLong('$',static_cast<long long>(len));
+	if (ref == NULL || len < REPLY_COPY_THRESHOLD) {
+		this->addCopy(data,len);
+		this->addCopy(REPLY_CRLF,2);
+	} else {
+		this->addRef(data,len,ref);
+		this->addStatic(REPLY_CRLF,2);
+	}
+}
+
+/* Drop the first 'nwritten' bytes, and resume a partial fragment where it
+* stopped. With 'send' the fragments that went out are pinned to it. */
+void ReplyChain::consume(size_t nwritten, ReplyZeroCopySend* send){
+	this->pending -= nwritten;
+	while (nwritten > 0) {
+		ReplySegment& head = this->segments.front();
+		if (send && head.ref) {
+			head.ref->retain();
+			send->pinned.push_back(head.ref);
+		}
+		if (head.len > nwritten) {
+			head.data += nwritten;
+			head.len -= nwritten;
+			break;
+		}
+		nwritten -= head.len;
+		if (head.ref) {
+			head.ref->release();
+		}
+		this->segments.pop_front();
+	}
+}
+
+/* The null of RESP3, or the null bulk for RESP2 clients */
+void ReplyChain::addNull(){
+	if (this->resp == 3) {
+		this->addStatic(REPLY_NULL,sizeof(REPLY_NULL)-1);
+	} else {
+		this->addStatic(REPLY_NULL_BULK,sizeof(REPLY_NULL_BULK)-1);
+	}
+}
+
+/* Write as much of the chain as the socket takes, ANET_IOV_MAX fragments
+* per system call. Returns the number of bytes written, or -1 with errno
+* set if nothing could be written (EAGAIN when the socket is full). */
+ssize_t ReplyChain::writeTo(int fd){
+	struct iovec iov[ANET_IOV_MAX];
+	ssize_t totwritten = 0;
+	if (this->autoCork && !this->segments.empty()) {
+		this->autoCork->cork(fd);
+	}
+	while (!this->segments.empty()) {
+		int iovcnt = 0;
+		int zerocopy = 0;
+		int inlined = 0;
+		size_t wanted = 0;
+		for (ReplySegmentQueue_t::const_iterator it = this->segments.begin();
+			it != this->segments.end() && iovcnt < ANET_IOV_MAX; ++ it)
+		{
+			iov[iovcnt].iov_base = const_cast<char*>(it->data);
+			iov[iovcnt].iov_len = it->len;
+			wanted += it->len;
+			iovcnt ++;
+			if (this->zerocopyThreshold && it->ref &&
+				it->len >= this->zerocopyThreshold)
+			{
+				zerocopy = 1;
+			}
+			inlined |= it->ref == &this->inlineChunk;
+		}
+		if (inlined) {
+			/* Copied before zero copy was enabled: the inline buffer
+			* can't outlive the chain, so it is never pinned */
+			zerocopy = 0;
+		}
+		ssize_t nwritten = zerocopy ? anetWritevZeroCopy(fd,iov,iovcnt) :
+			anetWritev(fd,iov,iovcnt);
+		if (this->writeSizes) {
+			this->writeSizes->add(nwritten > 0 ? nwritten : 0);
+		}
+		if (nwritten <= 0) {
+			if (totwritten > 0) {
+				break;
+			}
+			return nwritten;
+		}
+		totwritten += nwritten;
+
+		if (zerocopy) {
+			ReplyZeroCopySend send;
+			send.seq = this->zerocopySeq ++;
+			this->inflight.push_back(send);
+			this->zerocopySends ++;
+			this->consume(static_cast<size_t>(nwritten),&this->inflight.back());
+		} else {
+			this->consume(static_cast<size_t>(nwritten),NULL);
+		}
+		if (static_cast<size_t>(nwritten) < wanted) {
+			/* The socket buffer is full */
+			break;
+		}
+	}
+	if (this->segments.empty()) {
+		this->rewind();
+	}
+	return totwritten;
+}
+
+int ReplyChain::enableZeroCopy(char* err, int fd, size_t threshold){
+	if (anetEnableZeroCopy(err,fd) == ANET_ERR) {
+		return ANET_ERR;
+	}
+	this->zerocopyThreshold = threshold;
+	if (threshold && this->tail == &this->inlineChunk) {
+		this->grow();
+	}
+	return ANET_OK;
+}
+
+/* Read the MSG_ZEROCOPY completions of 'fd' and unpin the fragments of
+* the sends that are done. If the kernel reports it had to copy the data
+* anyway, zero copy is turned off for this chain. Returns the number of
+* sends completed, or -1 on error. */
+int ReplyChain::reapZeroCopy(int fd){
+	int copied = 0;
+	int completed = reapCompletions(fd,this->inflight,&copied);
+	if (copied) {
+		this->zerocopyCopied += copied;
+		this->zerocopyThreshold = 0;
+	}
+	return completed;
+}
+
+void ReplyChain::takeZeroCopy(ReplyZeroCopyQueue_t& queue){
+	queue.insert(queue.end(),this->inflight.begin(),this->inflight.end());
+	this->inflight.clear();
+}
+
+/* Drop every pending fragment, e.g. when the client is closed */
+void ReplyChain::clear(){
+	for (ReplySegmentQueue_t::iterator it = this->segments.begin();
+		it != this->segments.end(); ++ it)
+	{
+		if (it->ref) {
+			it->ref->release();
+		}
+	}
+	this->segments.clear();
+	this->pending = 0;
+	this->rewind();
+}
+
+AutoCork::AutoCork()
+:eventLoop(NULL),
+hookId(AE_ERR),
+corks(0)
+{}
+
+AutoCork::~AutoCork(){
+	this->detach();
+}
+
+int AutoCork::attach(EventLoop* eventLoop, int order){
+	this->detach();
+	this->hookId = eventLoop->addSleepHook(AE_BEFORE_SLEEP,order,beforeSleep,this);
+	if (this->hookId == AE_ERR) {
+		return AE_ERR;
+	}
+	this->eventLoop = eventLoop;
+	return AE_OK;
+}
+
+void AutoCork::detach(){
+	this->flush();
+	if (this->eventLoop) {
+		this->eventLoop->removeSleepHook(this->hookId);
+		this->eventLoop = NULL;
+		this->hookId = AE_ERR;
+	}
+}
+
+/* Cork 'fd' until the loop goes to sleep, if it isn't already */
+void AutoCork::cork(int fd){
+	if (fd >= static_cast<int>(this->isCorked.size())) {
+		this->isCorked.resize(fd+1,0);
+	}
+	if (this->isCorked[fd]) {
+		return;
+	}
+	if (anetEnableTcpCork(NULL,fd) == ANET_OK) {
+		this->isCorked[fd] = 1;
+		this->corked.push_back(fd);
+		this->corks ++;
+	}
+}
+
+/* 'fd' is about to be closed: closing sends what is corked anyway, and
+* the number may come back from accept() before the loop sleeps. */
+void AutoCork::forget(int fd){
+	if (fd < static_cast<int>(this->isCorked.size()) && this->isCorked[fd]) {
+		this->isCorked[fd] = 0;
+		for (size_t i = 0; i < this->corked.size(); ++ i) {
+			if (this->corked[i] == fd) {
+				this->corked[i] = this->corked.back();
+				this->corked.pop_back();
+				break;
+			}
+		}
+	}
+}
+
+/* Push out what the corked sockets hold */
+void AutoCork::flush(){
+	for (size_t i = 0; i < this->corked.size(); ++ i) {
+		int fd = this->corked[i];
+		this->isCorked[fd] = 0;
+		anetDisableTcpCork(NULL,fd);
+	}
+	this->corked.clear();
+}
+
+int AutoCork::beforeSleep(EventLoop* eventLoop, void* clientData, long long deadline){
+	reinterpret_cast<AutoCork*>(clientData)->flush();
+	return 0;
+}
+
+/* Polls the error queues of a ReplyReaper while it has sockets */
+struct ReplyReaperTimer : public TimeEvent{
+	ReplyReaper* reaper;
+
+	ReplyReaperTimer(ReplyReaper* reaper)
+		:reaper(reaper)
+	{}
+
+	virtual int onTimer(EventLoop* eventLoop, long id){
+		if (this->reaper == NULL) {
+			return AE_NOMORE;
+		}
+		this->reaper->reap();
+		if (this->reaper->graves.empty()) {
+			this->reaper->timer = NULL;
+			this->reaper->timerId = -1;
+			this->reaper = NULL;
+			return AE_NOMORE;
+		}
+		return REPLY_REAP_INTERVAL_MS;
+	}
+};
+
+ReplyReaper::ReplyReaper()
+:eventLoop(NULL),
+timer(NULL),
+timerId(-1),
+adopted(0),
+resets(0)
+{}
+
+/* What is left is reset: the event loop goes away */
+ReplyReaper::~ReplyReaper(){
+	for (size_t i = 0; i < this->graves.size(); ++ i) {
+		this->bury(this->graves[i],1);
+	}
+	this->graves.clear();
+	if (this->timer) {
+		this->timer->reaper = NULL;
+		this->eventLoop->deleteTimeEvent(this->timerId);
+	}
+}
+
+void ReplyReaper::adopt(EventLoop* eventLoop, int fd, ReplyChain* chain){
+	ReplyGrave* grave = new ReplyGrave();
+	grave->fd = fd;
+	grave->deadline = eventLoop->now() + static_cast<long long>(REPLY_REAP_TIMEOUT_MS)*1000;
+	chain->takeZeroCopy(grave->inflight);
+	shutdown(fd,SHUT_WR);
+	this->graves.push_back(grave);
+	this->adopted ++;
+
+	this->eventLoop = eventLoop;
+	if (this->timer == NULL) {
+		this->timer = new ReplyReaperTimer(this);
+		this->timerId = eventLoop->createTimeEvent(this->timer,REPLY_REAP_INTERVAL_MS);
+	}
+}
+
+/* Close the sockets whose sends all completed, and reset those past
+* their deadline or whose error queue can't be read any more */
+void ReplyReaper::reap(){
+	long long now = this->eventLoop->now();
+	size_t kept = 0;
+	for (size_t i = 0; i < this->graves.size(); ++ i) {
+		ReplyGrave* grave = this->graves[i];
+		int copied = 0;
+		int retval = reapCompletions(grave->fd,grave->inflight,&copied);
+		if (grave->inflight.empty()) {
+			this->bury(grave,0);
+		} else if (retval == -1 || now >= grave->deadline) {
+			this->bury(grave,1);
+		} else {
+			this->graves[kept ++] = grave;
+		}
+	}
+	this->graves.resize(kept);
+}
+
+void ReplyReaper::bury(ReplyGrave* grave, int reset){
+	if (reset) {
+		anetSetLinger(NULL,grave->fd,0);
+		this->resets ++;
+	}
+	close(grave->fd);
+	for (ReplyZeroCopyQueue_t::iterator it = grave->inflight.begin();
+		it != grave->inflight.end(); ++ it)
+	{
+		unpin(*it);
+	}
+	delete grave;
+}
+
+}
@@ -0,0 +1,303 @@
+/************************************************************************/
+/*                                                                      */
+/************************************************************************/
+#ifndef _REDIS_REDISCPP_REPLY_H_
+#define _REDIS_REDISCPP_REPLY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <deque>
+#include <vector>
+
+namespace redis{
+
+	enum {
+		REPLY_INLINE_BYTES = 4096,  /* per chain, for the copied fragments */
+		REPLY_BLOCK_BYTES = 16*1024, /* chained after it when it is full */
+		REPLY_POOL_BLOCKS = 64,     /* free blocks a ReplyBlockPool keeps */
+		REPLY_COPY_THRESHOLD = 512, /* smaller payloads are copied, not referenced */
+		REPLY_ZEROCOPY_THRESHOLD = 32*1024, /* default for enableZeroCopy() */
+		REPLY_CORK_ORDER = 1000000, /* after the before sleep hooks that write */
+		REPLY_REAP_INTERVAL_MS = 10,   /* ReplyReaper polls the closed sockets */
+		REPLY_REAP_TIMEOUT_MS = 30000  /* then resets those still unacknowledged */
+	};
+
+	class EventLoop;
+	struct LatencyHistogram;
+
+	/* Automatic corking for the sockets of one event loop: the first write
+	* of an iteration to a socket sets TCP_CORK on it, and a before sleep
+	* hook removes the cork of every socket written to. The replies of a
+	* pipeline, or the messages a publish fans out, then leave in full
+	* segments once per iteration instead of one small packet per write.
+	* Sockets that never get written to cost nothing. */
+	class AutoCork{
+		EventLoop* eventLoop;
+		long hookId;
+		std::vector<int> corked;
+		std::vector<char> isCorked; /* by fd */
+
+		static int beforeSleep(EventLoop* eventLoop, void* clientData, long long deadline);
+	public:
+		long long corks;
+
+		AutoCork();
+		~AutoCork();
+
+		/* Must be detached before the event loop is destroyed */
+		int attach(EventLoop* eventLoop, int order = REPLY_CORK_ORDER);
+		void detach();
+		int attached() const{
+			return this->eventLoop != NULL;
+		}
+		void cork(int fd);
+		void forget(int fd);
+		void flush();
+	};
+
+	/* Keeps the memory of a referenced reply fragment alive until the chain
+	* has written it. The chain and the owner each hold a reference; the
+	* object is recycled, deleted by default, when the last one is released.
+	* Reply chains are used by a single event loop thread, so the count is
+	* not atomic. */
+	class ReplyRef{
+	protected:
+		int refcount;
+		virtual void recycle(){
+			delete this;
+		}
+	public:
+		ReplyRef()
+			:refcount(1)
+		{}
+		virtual ~ReplyRef(){}
+		void retain(){
+			this->refcount ++;
+		}
+		void release(){
+			if (-- this->refcount == 0) {
+				this->recycle();
+			}
+		}
+		int shared() const{
+			return this->refcount > 1;
+		}
+	};
+
+	class ReplyBlockPool;
+
+	/* Storage of the copied fragments: the inline buffer of a chain, or a
+	* REPLY_BLOCK_BYTES block. Consecutive copies land next to each other
+	* and are merged into a single segment, so a reply made of many small
+	* pieces still takes one iovec entry. */
+	struct ReplyChunk : public ReplyRef{
+		char* buf;
+		size_t used;
+		size_t size;
+		ReplyBlockPool* pool;
+		int block; /* allocated by ReplyBlockPool::allocate() */
+
+		ReplyChunk(char* buf, size_t size, ReplyBlockPool* pool, int block)
+			:buf(buf),used(0),size(size),pool(pool),block(block)
+		{}
+		size_t avail() const{
+			return this->size - this->used;
+		}
+		void reset(){
+			this->refcount = 1;
+			this->used = 0;
+		}
+	protected:
+		virtual void recycle();
+	};
+
+	/* Free reply blocks, shared by the chains of one event loop: a block
+	* goes back to the pool once written, and the next reply that outgrows
+	* an inline buffer takes it instead of calling the allocator. The pool
+	* must outlive the chains using it. */
+	class ReplyBlockPool{
+		std::vector<ReplyChunk*> blocks;
+		size_t max;
+	public:
+		long long allocs;
+		long long reuses;
+
+		ReplyBlockPool(size_t max = REPLY_POOL_BLOCKS);
+		~ReplyBlockPool();
+
+		static ReplyChunk* allocate(ReplyBlockPool* pool);
+		static void free(ReplyChunk* chunk);
+		ReplyChunk* get();
+		void put(ReplyChunk* chunk);
+		size_t size() const{
+			return this->blocks.size();
+		}
+	};
+
+	/* A fragment waiting to be written: 'ref' is NULL for static data */
+	struct ReplySegment{
+		const char* data;
+		size_t len;
+		ReplyRef* ref;
+	};
+
+	typedef std::deque<ReplySegment> ReplySegmentQueue_t;
+
+	/* A MSG_ZEROCOPY send the kernel may still read from */
+	struct ReplyZeroCopySend{
+		uint32_t seq;
+		std::vector<ReplyRef*> pinned;
+	};
+
+	typedef std::deque<ReplyZeroCopySend> ReplyZeroCopyQueue_t;
+
+	/* The output of a client as a list of fragments written with a single
+	* anetWritev() call, up to ANET_IOV_MAX of them at a time. Protocol
+	* constants are pointed to, small fragments such as the headers are
+	* copied into the inline buffer of the chain, then into pooled blocks,
+	* and large payloads are sent from where they live, pinned by a
+	* ReplyRef: a bulk reply of a 1MB value costs no memcpy at all. The
+	* inline buffer is reused as soon as everything was written. */
+	class ReplyChain{
+		ReplySegmentQueue_t segments;
+		ReplyChunk* tail; /* chunk the copies go to */
+		size_t pending;
+		ReplyBlockPool* pool;
+		int resp;
+		ReplyChunk inlineChunk;
+		char inlineBuf[REPLY_INLINE_BYTES];
+		AutoCork* autoCork;
+		LatencyHistogram* writeSizes;
+		size_t zerocopyThreshold; /* 0 when off */
+		uint32_t zerocopySeq;     /* number of the next zero copy send */
+		ReplyZeroCopyQueue_t inflight;
+
+		void push(const char* data, size_t len, ReplyRef* ref);
+		void consume(size_t nwritten, ReplyZeroCopySend* send);
+		void grow();
+		void rewind();
+
+		ReplyChain(const ReplyChain&);
+		ReplyChain& operator=(const ReplyChain&);
+	public:
+		long long zerocopySends;
+		long long zerocopyCopied; /* completions the kernel copied anyway */
+
+		ReplyChain(ReplyBlockPool* pool = NULL);
+		~ReplyChain();
+
+		/* 'data' must outlive the chain, e.g. a shared protocol constant */
+		void addStatic(const char* data, size_t len);
+		void addCopy(const char* data, size_t len);
+		/* Send 'data' in place: 'ref' is retained until it is written */
+		void addRef(const char* data, size_t len, ReplyRef* ref);
+		void addLongLong(char prefix, long long value);
+		void addMultiBulkLen(long long count){
+			this->addLongLong('*',count);
+		}
+		void addBulk(const char* data, size_t len, ReplyRef* ref);
+
+		/* The RESP3 aggregates fall back to arrays for RESP2 clients: a map
+		* becomes its keys and values in turn. */
+		void setResp(int resp){
+			this->resp = resp;
+		}
+		int getResp() const{
+			return this->resp;
+		}
+		void addMapLen(long long count){
+			this->resp == 3 ? this->addLongLong('%',count) : this->addLongLong('*',count*2);
+		}
+		void addSetLen(long long count){
+			this->addLongLong(this->resp == 3 ? '~' : '*',count);
+		}
+		void addPushLen(long long count){
+			this->addLongLong(this->resp == 3 ? '>' : '*',count);
+		}
+		void addNull();
+
+		ssize_t writeTo(int fd);
+		void clear();
+		/* Cork the socket on the first write of each iteration */
+		void setAutoCork(AutoCork* autoCork){
+			this->autoCork = autoCork;
+		}
+		/* Add the bytes of every write syscall to 'hist', 0 if it would block */
+		void setWriteStats(LatencyHistogram* hist){
+			this->writeSizes = hist;
+		}
+
+		/* Send the batches holding a referenced fragment of 'threshold'
+		* bytes or more with MSG_ZEROCOPY. The fragments stay pinned until
+		* the kernel is done with them, so the socket must be registered
+		* with AE_ERRQUEUE and its read handler call reapZeroCopy() when it
+		* sees AE_ERRQUEUE in its mask. The copies then go to pooled blocks
+		* only: the inline buffer dies with the chain. When the socket is
+		* closed before every send completed, hand it to a ReplyReaper. */
+		int enableZeroCopy(char* err, int fd, size_t threshold = REPLY_ZEROCOPY_THRESHOLD);
+		int reapZeroCopy(int fd);
+		/* Move the sends in flight to 'queue', for ReplyReaper::adopt() */
+		void takeZeroCopy(ReplyZeroCopyQueue_t& queue);
+		size_t zerocopyInflight() const{
+			return this->inflight.size();
+		}
+		size_t size() const{
+			return this->pending;
+		}
+		int empty() const{
+			return this->pending == 0;
+		}
+		size_t fragments() const{
+			return this->segments.size();
+		}
+	};
+
+	/* A closed socket with zero copy sends in flight */
+	struct ReplyGrave{
+		int fd;
+		long long deadline;
+		ReplyZeroCopyQueue_t inflight;
+	};
+
+	typedef std::vector<ReplyGrave*> ReplyGraveVector_t;
+
+	struct ReplyReaperTimer;
+
+	/* Takes over the sockets closed while MSG_ZEROCOPY sends were in
+	* flight. The kernel may still transmit, and retransmit, from the
+	* pinned fragments after the client is gone; a block released then
+	* goes back to the pool and into the reply of another client. So the
+	* socket is only shut down for writing, which still delivers the data
+	* and then the FIN, and a timer reaps its completions until they are
+	* all in: only then is it closed and are the fragments released. A
+	* peer that acknowledges nothing for REPLY_REAP_TIMEOUT_MS is reset
+	* with SO_LINGER 0, which drops the send queue, before the release.
+	*
+	* One per event loop, destroyed before it and before the block pool
+	* of the chains it adopts from. */
+	class ReplyReaper{
+		EventLoop* eventLoop;
+		ReplyReaperTimer* timer;
+		long timerId;
+		ReplyGraveVector_t graves;
+
+		void bury(ReplyGrave* grave, int reset);
+		friend struct ReplyReaperTimer;
+	public:
+		long long adopted;
+		long long resets;
+
+		ReplyReaper();
+		~ReplyReaper();
+
+		/* Owns 'fd' from now on, and the sends 'chain' has in flight */
+		void adopt(EventLoop* eventLoop, int fd, ReplyChain* chain);
+		void reap();
+		size_t size() const{
+			return this->graves.size();
+		}
+	};
+}
+
+#endif // _REDIS_REDISCPP_REPLY_H_
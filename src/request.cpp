@@ -0,0 +1,233 @@
+/************************************************************************/
+/*                                                                      */
+/************************************************************************/
+#include "request.h"
+#include "util.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <strings.h>
+
+namespace redis{ namespace{
+	enum {
+		REQ_STATE_START = 0,
+		REQ_STATE_MULTIBULK = 1,
+		REQ_STATE_INLINE = 2,
+		REQ_STATE_DONE = 3,
+		REQ_STATE_ERR = 4,
+
+		/* Arguments reserved up front: the count comes from the client */
+		REQ_RESERVE_ARGS = 1024
+	};
+
+	inline int isBlank(char c){
+		return c == ' ' || c == '\t';
+	}
+}
+
+int ArgView::equalsNoCase(const char* s) const{
+	return strlen(s) == this->len && strncasecmp(this->ptr,s,this->len) == 0;
+}
+
+RequestParser::RequestParser(){
+	this->reset();
+}
+
+void RequestParser::reset(){
+	this->state = REQ_STATE_START;
+	this->multibulklen = 0;
+	this->bulklen = -1;
+	this->start = this->pos = this->scan = 0;
+	this->offsets.clear();
+	this->views.clear();
+	this->error[0] = '\0';
+}
+
+/* Parse the requests of 'buf', 'len' bytes holding what was read so far:
+* the same buffer as the previous call, grown, and shifted by the bytes
+* discard() dropped. Returns REQ_DONE with the next command in argv(),
+* REQ_MORE if no command is complete, or REQ_ERR. Call it again after
+* REQ_DONE, until REQ_MORE, for the rest of a pipeline. */
+int RequestParser::parse(const char* buf, size_t len){
+	if (this->state == REQ_STATE_ERR) {
+		return REQ_ERR;
+	}
+	if (this->state == REQ_STATE_DONE) {
+		this->state = REQ_STATE_START;
+		this->offsets.clear();
+		this->views.clear();
+	}
+	for (;;) {
+		if (this->state == REQ_STATE_START) {
+			if (this->pos >= len) {
+				return REQ_MORE;
+			}
+			this->state = buf[this->pos] == '*' ? REQ_STATE_MULTIBULK : REQ_STATE_INLINE;
+		}
+		int retval = this->state == REQ_STATE_MULTIBULK ?
+			this->parseMultibulk(buf,len) : this->parseInline(buf,len);
+		if (retval != REQ_DONE) {
+			return retval;
+		}
+		if (!this->offsets.empty()) {
+			this->done(buf);
+			return REQ_DONE;
+		}
+		/* Empty line or "*0": nothing to run */
+		this->start = this->pos;
+		this->state = REQ_STATE_START;
+	}
+}
+
+/* The first LF between where the last search stopped and 'len', or NULL
+* after remembering where to resume */
+const char* RequestParser::findLine(const char* buf, size_t len){
+	size_t from = this->scan > this->pos ? this->scan : this->pos;
+	const char* found = from < len ?
+		reinterpret_cast<const char*>(memchr(buf+from,'\n',len-from)) : NULL;
+	this->scan = found ? found - buf : len;
+	return found;
+}
+
+/* Same for the first CRLF. A CR ending the buffer is looked at again, it
+* may be the first half of one. */
+const char* RequestParser::findCrlf(const char* buf, size_t len){
+	size_t from = this->scan > this->pos ? this->scan : this->pos;
+	const char* found = from < len ? memcrlf(buf+from,len-from) : NULL;
+	if (found == NULL) {
+		this->scan = len > from ? len - 1 : from;
+		return NULL;
+	}
+	this->scan = found - buf;
+	return found;
+}
+
+int RequestParser::parseMultibulk(const char* buf, size_t len){
+	const char* cr;
+	long ll;
+
+	if (this->multibulklen == 0) {
+		cr = this->findCrlf(buf,len);
+		if (cr == NULL) {
+			if (len - this->pos > REQ_MAX_INLINE) {
+				return this->fail("too big mbulk count string");
+			}
+			return REQ_MORE;
+		}
+		const char* p = buf + this->pos + 1;
+		if (!string2ll(p,cr-p,&ll) || ll > REQ_MAX_MULTIBULK) {
+			return this->fail("invalid multibulk length");
+		}
+		this->pos = cr - buf + 2;
+		if (ll <= 0) {
+			return REQ_DONE;
+		}
+		this->multibulklen = ll;
+		this->offsets.reserve(2 * (ll < REQ_RESERVE_ARGS ? ll : REQ_RESERVE_ARGS));
+	}
+
+	while (this->multibulklen) {
+		if (this->bulklen == -1) {
+			cr = this->findCrlf(buf,len);
+			if (cr == NULL) {
+				if (len - this->pos > REQ_MAX_INLINE) {
+					return this->fail("too big bulk count string");
+				}
+				return REQ_MORE;
+			}
+			if (buf[this->pos] != '$') {
+				return this->fail("expected '$', got '%c'",buf[this->pos]);
+			}
+			const char* p = buf + this->pos + 1;
+			if (!string2ll(p,cr-p,&ll) || ll < 0 || ll > REQ_MAX_BULK) {
+				return this->fail("invalid bulk length");
+			}
+			this->pos = cr - buf + 2;
+			this->bulklen = ll;
+		}
+		/* The payload is not looked at, only skipped */
+		if (len - this->pos < static_cast<size_t>(this->bulklen) + 2) {
+			return REQ_MORE;
+		}
+		this->offsets.push_back(this->pos);
+		this->offsets.push_back(this->bulklen);
+		this->pos += this->bulklen + 2;
+		this->bulklen = -1;
+		this->multibulklen --;
+	}
+	return REQ_DONE;
+}
+
+/* A line of blank separated arguments, as typed in telnet. There are no
+* quotes or escapes: redis-cli and the client libraries send multibulks. */
+int RequestParser::parseInline(const char* buf, size_t len){
+	const char* nl = this->findLine(buf,len);
+	if (nl == NULL) {
+		if (len - this->pos > REQ_MAX_INLINE) {
+			return this->fail("too big inline request");
+		}
+		return REQ_MORE;
+	}
+	size_t end = nl - buf;
+	if (end > this->pos && buf[end-1] == '\r') {
+		end --;
+	}
+	size_t i = this->pos;
+	while (i < end) {
+		while (i < end && isBlank(buf[i])) {
+			i ++;
+		}
+		const char* blank = i < end ? memblank(buf+i,end-i) : NULL;
+		size_t j = blank ? blank - buf : end;
+		if (j > i) {
+			this->offsets.push_back(i);
+			this->offsets.push_back(j - i);
+		}
+		i = j;
+	}
+	this->pos = nl - buf + 1;
+	return REQ_DONE;
+}
+
+/* The command is complete: point the views at 'buf' */
+void RequestParser::done(const char* buf){
+	this->views.resize(this->offsets.size() / 2);
+	for (size_t i = 0; i < this->views.size(); ++ i) {
+		this->views[i].ptr = buf + this->offsets[2*i];
+		this->views[i].len = this->offsets[2*i+1];
+	}
+	this->start = this->pos;
+	this->state = REQ_STATE_DONE;
+}
+
+int RequestParser::fail(const char* fmt, ...){
+	va_list ap;
+	va_start(ap,fmt);
+	vsnprintf(this->error,sizeof(this->error),fmt,ap);
+	va_end(ap);
+	this->state = REQ_STATE_ERR;
+	return REQ_ERR;
+}
+
+/* The caller dropped the first 'count' bytes of the buffer, at most
+* parsed(): shift the offsets of the request in progress. */
+void RequestParser::discard(size_t count){
+	this->start -= count;
+	this->pos -= count;
+	this->scan = this->scan > count ? this->scan - count : 0;
+	if (this->state != REQ_STATE_DONE) {
+		for (size_t i = 0; i < this->offsets.size(); i += 2) {
+			this->offsets[i] -= count;
+		}
+	}
+}
+
+size_t RequestParser::wanted(size_t len) const{
+	if (this->state != REQ_STATE_MULTIBULK || this->bulklen == -1) {
+		return 0;
+	}
+	size_t need = this->pos + static_cast<size_t>(this->bulklen) + 2;
+	return need > len ? need - len : 0;
+}
+
+}
@@ -0,0 +1,96 @@
+/************************************************************************/
+/*                                                                      */
+/************************************************************************/
+#ifndef _REDIS_REDISCPP_REQUEST_H_
+#define _REDIS_REDISCPP_REQUEST_H_
+
+#include "structs.h"
+
+#include <stddef.h>
+#include <string.h>
+#include <vector>
+
+namespace redis{
+
+	enum {
+		REQ_DONE = 0,  /* a whole command is in argv */
+		REQ_MORE = 1,  /* the buffer ends in the middle of a command */
+		REQ_ERR = -1,  /* protocol error, the client should be closed */
+
+		REQ_MAX_INLINE = 64*1024,         /* inline command or header line */
+		REQ_MAX_MULTIBULK = 1024*1024,    /* arguments per command */
+		REQ_MAX_BULK = 512*1024*1024,     /* bytes per argument */
+		REQ_ERR_LEN = 128
+	};
+
+	/* An argument of the current command, pointing into the read buffer */
+	struct ArgView{
+		const char* ptr;
+		size_t len;
+
+		/* Copy it, for a command that keeps the argument */
+		sds_t toSds() const{
+			return sds_t(this->ptr,this->ptr+this->len);
+		}
+		int equals(const char* s, size_t slen) const{
+			return this->len == slen && memcmp(this->ptr,s,slen) == 0;
+		}
+		int equalsNoCase(const char* s) const;
+	};
+
+	typedef std::vector<ArgView> ArgViewVector_t;
+
+	/* Incremental parser of the requests of a connection, multibulk or
+	* inline, working in place on its read buffer. The arguments come out as
+	* views into the buffer, so parsing a GET or a SET allocates nothing: a
+	* command copies what it keeps with ArgView::toSds().
+	*
+	* The state survives between calls, so a request split over several
+	* reads costs one pass over its bytes. The parser remembers offsets, not
+	* pointers: the buffer may grow and move between two calls, and the
+	* views are rebuilt from the buffer handed to the call that completes a
+	* command. They are valid until the buffer is next modified. */
+	class RequestParser{
+		int state;
+		long multibulklen;   /* arguments still to read */
+		long bulklen;        /* length of the argument being read, or -1 */
+		size_t start;        /* where the unfinished request begins */
+		size_t pos;          /* where parsing resumes */
+		size_t scan;         /* where the search for the end of line resumes */
+		std::vector<size_t> offsets; /* offset and length of each argument */
+		ArgViewVector_t views;
+		char error[REQ_ERR_LEN];
+
+		int parseMultibulk(const char* buf, size_t len);
+		int parseInline(const char* buf, size_t len);
+		const char* findLine(const char* buf, size_t len);
+		const char* findCrlf(const char* buf, size_t len);
+		int fail(const char* fmt, ...);
+		void done(const char* buf);
+	public:
+		RequestParser();
+
+		int parse(const char* buf, size_t len);
+		void discard(size_t count);
+		void reset();
+
+		int argc() const{
+			return static_cast<int>(this->views.size());
+		}
+		const ArgView* argv() const{
+			return this->views.empty() ? NULL : &this->views[0];
+		}
+		/* Bytes at the head of the buffer used by complete requests */
+		size_t parsed() const{
+			return this->start;
+		}
+		/* Bytes the current argument still needs past the end of 'len', so
+		* a large value can be read with a single buffer growth */
+		size_t wanted(size_t len) const;
+		const char* getError() const{
+			return this->error;
+		}
+	};
+}
+
+#endif // _REDIS_REDISCPP_REQUEST_H_
@@ -3,11 +3,17 @@
 /************************************************************************/
 #include "config.h"
 #include "rio.h"
+#include "proto.h"
 #include "util.h"
 #include "debug.h"
 
+#include <string.h>
+
 
 namespace redis { namespace{
+	enum {
+		RIO_BULK_INLINE = 64 /* bulks written with a single write() */
+	};
 
 	struct BufferedRIO : public RIO {
 		sds_t* buf;
@@ -85,27 +91,33 @@ RIO* rioInitWithFile(FILE* fp){
 
 /* Write multi bulk count in the format: "*<count>\r\n". */
 size_t rioWriteBulkCount(RIO *r, char prefix, int count) {
-    char cbuf[128];
-    int clen;
+    char cbuf[PROTO_HEADER_MAX];
+    size_t clen = protoHeader(cbuf,prefix,count);
 
-    cbuf[0] = prefix;
-    clen = 1+ll2string(cbuf+1,sizeof(cbuf)-1,count);
-    cbuf[clen++] = '\r';
-    cbuf[clen++] = '\n';
 	if (r->write(cbuf,clen) == 0) {
 		return 0;
 	}
     return clen;
 }
 
-/* Write binary-safe string in the format: "$<count>\r\n<payload>\r\n". */
+/* Write binary-safe string in the format: "$<count>\r\n<payload>\r\n".
+ * Short strings are formatted in one buffer and written at once. */
 size_t rioWriteBulkString(RIO *r, const char *buf, size_t len) {
+    char sbuf[PROTO_HEADER_MAX+RIO_BULK_INLINE+2];
     size_t nwritten;
 
+	if (len <= RIO_BULK_INLINE) {
+		nwritten = protoHeader(sbuf,'$',len);
+		memcpy(sbuf+nwritten,buf,len);
+		nwritten += len;
+		sbuf[nwritten++] = '\r';
+		sbuf[nwritten++] = '\n';
+		return r->write(sbuf,nwritten) == 0 ? 0 : nwritten;
+	}
 	if ((nwritten = rioWriteBulkCount(r,'$',len)) == 0) {
 		return 0;
 	}
-	if (len > 0 && r->write(buf,len) == 0) {
+	if (r->write(buf,len) == 0) {
 		return 0;
 	}
 	if (r->write("\r\n",2) == 0) {
@@ -0,0 +1,272 @@
+/************************************************************************/
+/*                                                                      */
+/************************************************************************/
+#include "timewheel.h"
+#include "ae.h"
+
+namespace redis{ namespace{
+	/* How long the ticker sleeps when the wheel is empty: schedule() wakes
+	* it up as soon as there is something to expire. */
+	const long long WHEEL_IDLE_US = 1000000;
+
+	inline void unlink(WheelTimer* t){
+		t->prev->next = t->next;
+		t->next->prev = t->prev;
+		t->prev = t->next = NULL;
+	}
+}
+
+/* Drives a TimingWheel from the event loop: one time event per wheel tick.
+* An expiry callback may detach the wheel: the ticker is then only
+* unhooked from it, and deleted by the event loop once the tick ends. */
+struct WheelTicker : public TimeEvent{
+	TimingWheel* wheel;
+	int idle;
+	int running; /* inside advance() */
+
+	WheelTicker(TimingWheel* wheel)
+		:wheel(wheel),idle(0),running(0)
+	{}
+
+	virtual int onTimer(EventLoop* eventLoop, long id){
+		long long now = eventLoop->now();
+		this->running = 1;
+		this->wheel->advance(now);
+		this->running = 0;
+		if (this->wheel == NULL) {
+			/* Detached by a callback */
+			return AE_NOMORE;
+		}
+
+		long long next = 0;
+		if (this->wheel->backlog()) {
+			/* Out of budget: come back on the next iteration */
+			next = 0;
+		} else if (this->wheel->size() == 0) {
+			this->idle = 1;
+			next = WHEEL_IDLE_US;
+		} else {
+			next = this->nextTick(now);
+		}
+		eventLoop->rescheduleTimeEventUs(id,next);
+		return 0;
+	}
+
+	virtual void onFinalizer(EventLoop* eventLoop){
+		if (this->wheel) {
+			TimingWheel* wheel = this->wheel;
+			this->wheel = NULL;
+			wheel->detach();
+		}
+	}
+
+	long long nextTick(long long now) const{
+		long long next = this->wheel->nextTickTime() - now;
+		return next > 0 ? next : 0;
+	}
+};
+
+void WheelList::push(WheelTimer* t){
+	t->prev = this->prev;
+	t->next = this;
+	this->prev->next = t;
+	this->prev = t;
+}
+
+void WheelList::splice(WheelList* other){
+	if (other->empty()) {
+		return;
+	}
+	WheelTimer* first = other->next;
+	WheelTimer* last = other->prev;
+	first->prev = this->prev;
+	last->next = this;
+	this->prev->next = first;
+	this->prev = last;
+	other->prev = other->next = other;
+}
+
+TimingWheel::TimingWheel(long long tickUs, int budget)
+:tickUs(tickUs > 0 ? tickUs : 1),
+current(0),
+budget(budget),
+count(0),
+eventLoop(NULL),
+ticker(NULL),
+tickerId(-1),
+fired(0),
+cascaded(0),
+deferred(0)
+{}
+
+TimingWheel::~TimingWheel(){
+	/* The timers belong to the caller: just unlink them */
+	for (int level = 0; level < WHEEL_LEVELS; ++ level) {
+		for (int slot = 0; slot < WHEEL_SLOTS; ++ slot) {
+			WheelList& list = this->slots[level][slot];
+			while (!list.empty()) {
+				unlink(list.next);
+			}
+		}
+	}
+	while (!this->cascading.empty()) {
+		unlink(this->cascading.next);
+	}
+	while (!this->expired.empty()) {
+		unlink(this->expired.next);
+	}
+	this->detach();
+}
+
+/* Put the timer in the finest level whose span covers its deadline. A
+* timer of level N is redistributed to the levels below when the wheel
+* reaches its slot, and ends in level 0 by the time it expires. */
+void TimingWheel::place(WheelTimer* t){
+	long long delta = t->expires - this->current;
+	if (delta < 0) {
+		this->expired.push(t);
+		return;
+	}
+
+	long long expires = t->expires;
+	const long long span = 1LL << (WHEEL_BITS*WHEEL_LEVELS);
+	if (delta >= span) {
+		/* Too far away: park it in the last slot, place() will be called
+		* again when that slot is redistributed. */
+		expires = this->current + span - 1;
+		delta = span - 1;
+	}
+	int level = 0;
+	while (delta >= (1LL << (WHEEL_BITS*(level+1)))) {
+		level ++;
+	}
+	int slot = static_cast<int>((expires >> (WHEEL_BITS*level)) & WHEEL_MASK);
+	this->slots[level][slot].push(t);
+}
+
+/* Expire the tick 'current'. When level 0 wraps, the matching slot of the
+* next level is queued for redistribution, and so on up the levels. */
+void TimingWheel::step(){
+	int idx = static_cast<int>(this->current & WHEEL_MASK);
+	if (idx == 0) {
+		for (int level = 1; level < WHEEL_LEVELS; ++ level) {
+			int slot = static_cast<int>((this->current >> (WHEEL_BITS*level)) & WHEEL_MASK);
+			this->cascading.splice(&this->slots[level][slot]);
+			if (slot != 0) {
+				break;
+			}
+		}
+	}
+	this->expired.splice(&this->slots[0][idx]);
+	this->current ++;
+}
+
+/* Schedule 't' to expire at 'when', a monotonic time in microseconds as
+* returned by EventLoop::now(). Rescheduling a pending timer moves it. */
+void TimingWheel::schedule(WheelTimer* t, long long when){
+	if (t->pending()) {
+		this->cancel(t);
+	}
+	if (this->count == 0 && this->eventLoop) {
+		/* The wheel stopped ticking while empty: catch up for free */
+		long long now = this->eventLoop->now() / this->tickUs;
+		if (now > this->current) {
+			this->current = now;
+		}
+	}
+	/* Round up, a timer never expires early */
+	t->expires = (when + this->tickUs - 1) / this->tickUs;
+	this->place(t);
+	this->count ++;
+	this->wakeup();
+}
+
+void TimingWheel::cancel(WheelTimer* t){
+	if (t->pending()) {
+		unlink(t);
+		this->count --;
+	}
+}
+
+/* Move the wheel up to 'now' and fire the due timers, doing at most
+* 'budget' units of work (a redistributed or a fired timer). Returns the
+* number of timers fired. */
+int TimingWheel::advance(long long now){
+	long long target = now / this->tickUs;
+	if (this->count == 0) {
+		if (this->current <= target) {
+			this->current = target + 1;
+		}
+		return 0;
+	}
+	while (this->current <= target) {
+		this->step();
+	}
+
+	int work = 0;
+	while (work < this->budget && !this->cascading.empty()) {
+		WheelTimer* t = this->cascading.next;
+		unlink(t);
+		this->place(t);
+		this->cascaded ++;
+		work ++;
+	}
+
+	int processed = 0;
+	while (work < this->budget && !this->expired.empty()) {
+		WheelTimer* t = this->expired.next;
+		unlink(t);
+		this->count --;
+		/* May schedule itself again or cancel other timers */
+		t->onExpire(this);
+		this->fired ++;
+		processed ++;
+		work ++;
+	}
+	if (this->backlog()) {
+		this->deferred ++;
+	}
+	return processed;
+}
+
+long long TimingWheel::nextTickTime() const{
+	return this->current * this->tickUs;
+}
+
+int TimingWheel::attach(EventLoop* eventLoop){
+	this->detach();
+	this->ticker = new WheelTicker(this);
+	long long now = eventLoop->now();
+	if (this->count == 0) {
+		this->current = now / this->tickUs;
+	}
+	this->tickerId = eventLoop->createTimeEventUs(this->ticker,this->ticker->nextTick(now));
+	this->eventLoop = eventLoop;
+	return AE_OK;
+}
+
+void TimingWheel::detach(){
+	if (this->ticker) {
+		WheelTicker* ticker = this->ticker;
+		this->ticker = NULL;
+		if (ticker->wheel) {
+			ticker->wheel = NULL;
+			if (!ticker->running) {
+				this->eventLoop->deleteTimeEvent(this->tickerId);
+			}
+		}
+	}
+	this->eventLoop = NULL;
+	this->tickerId = -1;
+}
+
+/* Start ticking again after the wheel went idle */
+void TimingWheel::wakeup(){
+	if (this->ticker && this->ticker->idle) {
+		this->ticker->idle = 0;
+		this->eventLoop->rescheduleTimeEventUs(this->tickerId,
+			this->ticker->nextTick(this->eventLoop->now()));
+	}
+}
+
+}
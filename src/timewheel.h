@@ -0,0 +1,109 @@
+/************************************************************************/
+/*                                                                      */
+/************************************************************************/
+#ifndef _REDIS_REDISCPP_TIMEWHEEL_H_
+#define _REDIS_REDISCPP_TIMEWHEEL_H_
+
+#include <stddef.h>
+
+namespace redis{
+
+	enum {
+		WHEEL_LEVELS = 4,
+		WHEEL_BITS = 8,
+		WHEEL_SLOTS = (1<<WHEEL_BITS),
+		WHEEL_MASK = (WHEEL_SLOTS-1)
+	};
+
+	class EventLoop;
+	class TimingWheel;
+
+	/* A timer owned by the caller and linked into the wheel in place, so
+	* scheduling and cancelling never allocate. Key TTLs and client timeouts
+	* embed or derive from it. */
+	class WheelTimer{
+	public:
+		long long expires; /* deadline, in wheel ticks */
+		WheelTimer* prev;
+		WheelTimer* next;
+		WheelTimer()
+			:expires(0),prev(NULL),next(NULL)
+		{}
+		virtual ~WheelTimer(){}
+		virtual void onExpire(TimingWheel* wheel){}
+		bool pending() const{
+			return this->prev != NULL;
+		}
+	};
+
+	/* Circular list with a sentinel node: O(1) link, unlink and splice. */
+	struct WheelList : public WheelTimer{
+		WheelList(){
+			this->prev = this->next = this;
+		}
+		bool empty() const{
+			return this->next == this;
+		}
+		void push(WheelTimer* t);
+		void splice(WheelList* other);
+	};
+
+	struct WheelTicker;
+
+	/* Hierarchical timing wheel (Varghese & Lauck): WHEEL_LEVELS levels of
+	* WHEEL_SLOTS slots, each level WHEEL_SLOTS times coarser than the one
+	* below, covering 2^32 ticks. Inserting and cancelling are O(1), a tick
+	* moves a whole slot to the expired list at once, and the timers of a
+	* coarser slot are redistributed only when the wheel reaches it.
+	*
+	* Both the redistribution and the firing are bounded by a work budget per
+	* advance() call: whatever is left over is carried to the next tick, so a
+	* burst of millions of expirations turns into a slightly late but steady
+	* stream instead of a latency spike. */
+	class TimingWheel{
+		long long tickUs;
+		long long current; /* next tick to expire */
+		int budget;
+		size_t count;
+		WheelList slots[WHEEL_LEVELS][WHEEL_SLOTS];
+		WheelList cascading; /* coarse slots waiting to be redistributed */
+		WheelList expired;   /* due timers waiting for the budget */
+		EventLoop* eventLoop;
+		WheelTicker* ticker;
+		long tickerId;
+
+		void place(WheelTimer* t);
+		void step();
+	public:
+		long long fired;
+		long long cascaded;
+		long long deferred; /* advance() calls that ran out of budget */
+
+		TimingWheel(long long tickUs = 1000, int budget = 1000);
+		~TimingWheel();
+
+		void schedule(WheelTimer* t, long long when);
+		void cancel(WheelTimer* t);
+		int advance(long long now);
+		int backlog() const{
+			return !this->cascading.empty() || !this->expired.empty();
+		}
+		size_t size() const{
+			return this->count;
+		}
+		long long getTickUs() const{
+			return this->tickUs;
+		}
+		long long nextTickTime() const;
+		void setBudget(int budget){
+			this->budget = budget;
+		}
+
+		/* The wheel must be detached before the event loop is destroyed */
+		int attach(EventLoop* eventLoop);
+		void detach();
+		void wakeup();
+	};
+}
+
+#endif // _REDIS_REDISCPP_TIMEWHEEL_H_
@@ -0,0 +1,416 @@
+/************************************************************************/
+/*                                                                      */
+/************************************************************************/
+#include "tracking.h"
+#include "ae.h"
+#include "networking.h"
+
+#include <string.h>
+#include <algorithm>
+
+namespace redis{ namespace{
+	const char TRACKING_INVALIDATE[] = "invalidate";
+
+	/* FNV-1a */
+	size_t trackingHash(const char* key, size_t len){
+		unsigned long long hash = 14695981039346656037ULL;
+		for (size_t j = 0; j < len; j++) {
+			hash ^= static_cast<unsigned char>(key[j]);
+			hash *= 1099511628211ULL;
+		}
+		return static_cast<size_t>(hash);
+	}
+
+	void addId(ClientIdVector_t& ids, long long id){
+		if (std::find(ids.begin(),ids.end(),id) == ids.end()) {
+			ids.push_back(id);
+		}
+	}
+}
+
+TrackingTable::TrackingTable(ClientManager* manager)
+:manager(manager),
+buckets(TRACKING_INITIAL_BUCKETS,static_cast<TrackedKey*>(NULL)),
+count(0),
+maxKeys(TRACKING_MAX_KEYS),
+evictCursor(0),
+sweepCursor(0),
+sweepPending(0),
+pendingPrefixes(0),
+eventLoop(NULL),
+hookId(AE_ERR),
+invalidations(0),
+evictions(0)
+{}
+
+TrackingTable::~TrackingTable(){
+	for (size_t i = 0; i < this->buckets.size(); ++ i) {
+		TrackedKey* entry = this->buckets[i];
+		while (entry) {
+			TrackedKey* next = entry->next;
+			delete entry;
+			entry = next;
+		}
+	}
+	this->detach();
+}
+
+/* Flush the broadcasts from the before sleep hooks of 'eventLoop'. The
+* table must be detached before the event loop is destroyed. */
+int TrackingTable::attach(EventLoop* eventLoop){
+	this->detach();
+	this->hookId = eventLoop->addSleepHook(AE_BEFORE_SLEEP,TRACKING_FLUSH_ORDER,
+		beforeSleep,this);
+	if (this->hookId == AE_ERR) {
+		return AE_ERR;
+	}
+	this->eventLoop = eventLoop;
+	return AE_OK;
+}
+
+void TrackingTable::detach(){
+	if (this->eventLoop) {
+		this->eventLoop->removeSleepHook(this->hookId);
+		this->eventLoop = NULL;
+		this->hookId = AE_ERR;
+	}
+}
+
+TrackedKey* TrackingTable::find(const char* key, size_t len, size_t hash) const{
+	TrackedKey* entry = this->buckets[hash & (this->buckets.size()-1)];
+	while (entry) {
+		if (entry->hash == hash && entry->key.size() == len &&
+			(len == 0 || memcmp(&entry->key[0],key,len) == 0))
+		{
+			return entry;
+		}
+		entry = entry->next;
+	}
+	return NULL;
+}
+
+/* Double the buckets, keeping the load factor under 1 */
+void TrackingTable::rehash(){
+	std::vector<TrackedKey*> buckets(this->buckets.size()*2,static_cast<TrackedKey*>(NULL));
+	size_t mask = buckets.size() - 1;
+	for (size_t i = 0; i < this->buckets.size(); ++ i) {
+		TrackedKey* entry = this->buckets[i];
+		while (entry) {
+			TrackedKey* next = entry->next;
+			entry->next = buckets[entry->hash & mask];
+			buckets[entry->hash & mask] = entry;
+			entry = next;
+		}
+	}
+	this->buckets.swap(buckets);
+	/* The cursors now point elsewhere: start the pass over */
+	if (this->sweepPending) {
+		this->sweepPending = this->buckets.size();
+	}
+}
+
+/* Turn tracking on for 'c'. In broadcast mode 'prefixes' are the key
+* prefixes it wants to hear about, all keys if there are none. */
+void TrackingTable::enable(Client* c, int bcast, const std::vector<sds_t>& prefixes, int noloop){
+	if (c->flags & CLIENT_TRACKING) {
+		this->disable(c);
+	}
+	c->flags |= CLIENT_TRACKING;
+	if (noloop) {
+		c->flags |= CLIENT_TRACKING_NOLOOP;
+	}
+	if (bcast) {
+		c->flags |= CLIENT_TRACKING_BCAST;
+		if (prefixes.empty()) {
+			addId(this->prefixes[sds_t()].clients,c->id);
+		}
+		for (size_t i = 0; i < prefixes.size(); ++ i) {
+			addId(this->prefixes[prefixes[i]].clients,c->id);
+		}
+	}
+}
+
+/* Turn tracking off for 'c'. The keys it read keep its id until they
+* change, or until a sweep of the table drops it. */
+void TrackingTable::disable(Client* c){
+	if (c->flags & CLIENT_TRACKING_BCAST) {
+		TrackedPrefixMap_t::iterator it = this->prefixes.begin();
+		while (it != this->prefixes.end()) {
+			ClientIdVector_t& ids = it->second.clients;
+			ids.erase(std::remove(ids.begin(),ids.end(),c->id),ids.end());
+			if (ids.empty()) {
+				this->prefixes.erase(it++);
+			} else {
+				++ it;
+			}
+		}
+	}
+	c->flags &= ~(CLIENT_TRACKING|CLIENT_TRACKING_BCAST|CLIENT_TRACKING_NOLOOP);
+	this->sweepPending = this->buckets.size();
+}
+
+/* 'c' read 'key': tell it when the key changes */
+void TrackingTable::rememberKey(Client* c, const char* key, size_t len){
+	size_t hash = trackingHash(key,len);
+	TrackedKey* entry = this->find(key,len,hash);
+	if (entry == NULL) {
+		/* Make room first, so that the key read is not the one to go */
+		while (this->maxKeys && this->count >= this->maxKeys) {
+			this->evictKey();
+		}
+		entry = new TrackedKey();
+		entry->hash = hash;
+		entry->key.assign(key,key+len);
+		size_t slot = hash & (this->buckets.size()-1);
+		entry->next = this->buckets[slot];
+		this->buckets[slot] = entry;
+		if (++ this->count > this->buckets.size()) {
+			this->rehash();
+		}
+	}
+	addId(entry->clients,c->id);
+}
+
+/* 'key' changed, because of 'by' or NULL: invalidate it for the clients
+* that read it, and queue it for the broadcast prefixes it falls under */
+void TrackingTable::invalidateKey(const char* key, size_t len, Client* by){
+	size_t hash = trackingHash(key,len);
+	TrackedKey* entry = this->find(key,len,hash);
+	if (entry) {
+		this->dropKey(entry,by);
+	}
+
+	for (TrackedPrefixMap_t::iterator it = this->prefixes.begin();
+		it != this->prefixes.end(); ++ it)
+	{
+		const sds_t& prefix = it->first;
+		if (prefix.size() > len ||
+			(!prefix.empty() && memcmp(&prefix[0],key,prefix.size()) != 0))
+		{
+			continue;
+		}
+		it->second.keys.push_back(sds_t(key,key+len));
+		it->second.writers.push_back(by ? by->id : 0);
+		this->pendingPrefixes = 1;
+	}
+}
+
+/* Remove 'entry' and send its invalidation to the clients that read it,
+* but 'by' if it doesn't want to hear about its own writes */
+void TrackingTable::dropKey(TrackedKey* entry, Client* by){
+	/* Unlink it first: a client may get freed while writing to it */
+	TrackedKey** link = &this->buckets[entry->hash & (this->buckets.size()-1)];
+	while (*link != entry) {
+		link = &(*link)->next;
+	}
+	*link = entry->next;
+	this->count --;
+
+	std::vector<const sds_t*> keys(1,&entry->key);
+	for (size_t i = 0; i < entry->clients.size(); ++ i) {
+		Client* c = this->manager->lookupClient(entry->clients[i]);
+		if (c == NULL || (c->flags & (CLIENT_TRACKING|CLIENT_TRACKING_BCAST)) != CLIENT_TRACKING) {
+			continue;
+		}
+		if (c == by && (c->flags & CLIENT_TRACKING_NOLOOP)) {
+			continue;
+		}
+		this->sendInvalidation(c,keys);
+	}
+	delete entry;
+}
+
+/* Invalidate a key to stay under maxKeys: the first one found from where
+* the last eviction stopped, so that the keys go in turn */
+void TrackingTable::evictKey(){
+	size_t mask = this->buckets.size() - 1;
+	while (this->buckets[this->evictCursor & mask] == NULL) {
+		this->evictCursor ++;
+	}
+	TrackedKey* entry = this->buckets[this->evictCursor & mask];
+	this->evictCursor ++;
+	this->dropKey(entry,NULL);
+	this->evictions ++;
+}
+
+/* Is client 'id' still there, and tracking in the default mode? */
+int TrackingTable::isTracking(long long id) const{
+	Client* c = this->manager->lookupClient(id);
+	return c && (c->flags & (CLIENT_TRACKING|CLIENT_TRACKING_BCAST)) == CLIENT_TRACKING;
+}
+
+/* Drop from 'buckets' buckets the ids of the clients that went away or
+* stopped tracking, and the keys left without a client */
+void TrackingTable::sweep(size_t buckets){
+	size_t mask = this->buckets.size() - 1;
+	for (; buckets > 0 && this->sweepPending > 0; -- buckets, -- this->sweepPending) {
+		TrackedKey** link = &this->buckets[this->sweepCursor ++ & mask];
+		while (*link) {
+			TrackedKey* entry = *link;
+			ClientIdVector_t& ids = entry->clients;
+			size_t kept = 0;
+			for (size_t i = 0; i < ids.size(); ++ i) {
+				if (this->isTracking(ids[i])) {
+					ids[kept ++] = ids[i];
+				}
+			}
+			ids.resize(kept);
+			if (ids.empty()) {
+				*link = entry->next;
+				this->count --;
+				delete entry;
+			} else {
+				link = &entry->next;
+			}
+		}
+	}
+}
+
+/* Send the keys changed under each broadcast prefix to its clients, one
+* push message per client and prefix */
+void TrackingTable::flushBroadcasts(){
+	if (!this->pendingPrefixes) {
+		return;
+	}
+	this->pendingPrefixes = 0;
+	std::vector<const sds_t*> keys;
+	for (TrackedPrefixMap_t::iterator it = this->prefixes.begin();
+		it != this->prefixes.end(); ++ it)
+	{
+		TrackedPrefix& prefix = it->second;
+		if (prefix.keys.empty()) {
+			continue;
+		}
+		for (size_t i = 0; i < prefix.clients.size(); ++ i) {
+			Client* c = this->manager->lookupClient(prefix.clients[i]);
+			if (c == NULL) {
+				continue;
+			}
+			keys.clear();
+			for (size_t k = 0; k < prefix.keys.size(); ++ k) {
+				if ((c->flags & CLIENT_TRACKING_NOLOOP) && prefix.writers[k] == c->id) {
+					continue;
+				}
+				keys.push_back(&prefix.keys[k]);
+			}
+			if (!keys.empty()) {
+				this->sendInvalidation(c,keys);
+			}
+		}
+		prefix.keys.clear();
+		prefix.writers.clear();
+	}
+}
+
+/* The RESP3 push ["invalidate", [key, ...]] */
+void TrackingTable::sendInvalidation(Client* c, const std::vector<const sds_t*>& keys){
+	c->reply.addPushLen(2);
+	c->reply.addBulk(TRACKING_INVALIDATE,sizeof(TRACKING_INVALIDATE)-1,NULL);
+	c->reply.addMultiBulkLen(keys.size());
+	for (size_t i = 0; i < keys.size(); ++ i) {
+		const sds_t& key = *keys[i];
+		c->reply.addBulk(key.empty() ? "" : &key[0],key.size(),NULL);
+	}
+	c->flushLater();
+	this->invalidations ++;
+}
+
+int TrackingTable::beforeSleep(EventLoop* eventLoop, void* clientData, long long deadline){
+	TrackingTable* table = reinterpret_cast<TrackingTable*>(clientData);
+	table->flushBroadcasts();
+	table->sweep(TRACKING_SWEEP_BUCKETS);
+	return 0;
+}
+
+}
+
+#ifdef TRACKING_TEST_MAIN
+#include <assert.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+	using namespace redis;
+
+	const int TEST_LOOP_FLAGS = AE_ALL_EVENTS|AE_DONT_WAIT|AE_CALL_BEFORE_SLEEP;
+
+	Client* trackingClient(EventLoop* el, ClientManager* manager){
+		int fds[2];
+		assert(socketpair(AF_UNIX,SOCK_STREAM,0,fds) == 0);
+		Client* c = manager->createClient(el,fds[0]);
+		assert(c != NULL);
+		manager->getTracking().enable(c,0,std::vector<sds_t>(),0);
+		return c;
+	}
+
+	/* Enough iterations for a full sweep of the table */
+	void sweepAll(EventLoop* el){
+		for (size_t i = 0; i <= TRACKING_INITIAL_BUCKETS/TRACKING_SWEEP_BUCKETS; ++ i) {
+			el->processEvents(TEST_LOOP_FLAGS);
+		}
+	}
+
+	void test_disconnect(EventLoop* el){
+		ClientManager manager;
+		TrackingTable& table = manager.getTracking();
+		Client* c = trackingClient(el,&manager);
+		table.rememberKey(c,"foo",3);
+		table.rememberKey(c,"bar",3);
+		assert(table.size() == 2);
+
+		/* The keys of a client that went away are swept */
+		manager.freeClient(c);
+		sweepAll(el);
+		assert(table.size() == 0);
+
+		/* A new client reading the key hears about its change */
+		Client* d = trackingClient(el,&manager);
+		table.rememberKey(d,"foo",3);
+		long long sent = table.invalidations;
+		table.invalidateKey("foo",3,NULL);
+		assert(table.invalidations == sent+1);
+		assert(table.size() == 0);
+	}
+
+	void test_reread(EventLoop* el){
+		ClientManager manager;
+		TrackingTable& table = manager.getTracking();
+		Client* c = trackingClient(el,&manager);
+		table.rememberKey(c,"foo",3);
+
+		/* Turned off: swept. Back on and read again: tracked again. */
+		table.disable(c);
+		sweepAll(el);
+		assert(table.size() == 0);
+		table.enable(c,0,std::vector<sds_t>(),0);
+		table.rememberKey(c,"foo",3);
+		assert(table.size() == 1);
+		long long sent = table.invalidations;
+		table.invalidateKey("foo",3,NULL);
+		assert(table.invalidations == sent+1);
+	}
+
+	void test_max_keys(EventLoop* el){
+		ClientManager manager;
+		TrackingTable& table = manager.getTracking();
+		table.setMaxKeys(2);
+		Client* c = trackingClient(el,&manager);
+		table.rememberKey(c,"a",1);
+		table.rememberKey(c,"b",1);
+		long long sent = table.invalidations;
+		table.rememberKey(c,"c",1);
+		assert(table.size() == 2);
+		assert(table.evictions == 1);
+		assert(table.invalidations == sent+1);
+	}
+}
+
+int main(void) {
+	redis::EventLoop el;
+	assert(el.init(1024) == AE_OK);
+	test_disconnect(&el);
+	test_reread(&el);
+	test_max_keys(&el);
+	return 0;
+}
+#endif
@@ -0,0 +1,108 @@
+/************************************************************************/
+/*                                                                      */
+/************************************************************************/
+#ifndef _REDIS_REDISCPP_TRACKING_H_
+#define _REDIS_REDISCPP_TRACKING_H_
+
+#include "structs.h"
+
+#include <stddef.h>
+#include <map>
+#include <vector>
+
+namespace redis{
+
+	enum {
+		TRACKING_INITIAL_BUCKETS = 1024,
+		TRACKING_MAX_KEYS = 1000000, /* default for setMaxKeys() */
+		TRACKING_SWEEP_BUCKETS = 256, /* cleaned per event loop iteration */
+		TRACKING_FLUSH_ORDER = 100 /* before sleep, ahead of the auto cork */
+	};
+
+	class Client;
+	class ClientManager;
+	class EventLoop;
+
+	typedef std::vector<long long> ClientIdVector_t;
+
+	/* A tracked key and the clients that read it since it last changed */
+	struct TrackedKey{
+		TrackedKey* next;
+		size_t hash;
+		sds_t key;
+		ClientIdVector_t clients;
+	};
+
+	/* A broadcast prefix: its clients, and the keys under it changed since
+	* the last flush, each with the id of the client that changed it */
+	struct TrackedPrefix{
+		ClientIdVector_t clients;
+		std::vector<sds_t> keys;
+		ClientIdVector_t writers;
+	};
+
+	typedef std::map<sds_t, TrackedPrefix> TrackedPrefixMap_t;
+
+	/* Server assisted client side caching. In the default mode the table
+	* remembers, per key, the ids of the clients that read it; the first
+	* change of the key sends them an invalidation push and forgets them,
+	* until they read it again. Past setMaxKeys() keys, the oldest bucket
+	* entries are invalidated to make room. The ids of a client that goes
+	* away or stops tracking are skipped when the key changes, and swept
+	* from the table a few buckets per iteration.
+	*
+	* In broadcast mode nothing is remembered per key. A client subscribes
+	* to prefixes instead, and gets the changed keys under them once per
+	* event loop iteration, from a before sleep hook. */
+	class TrackingTable{
+		ClientManager* manager;
+		std::vector<TrackedKey*> buckets;
+		size_t count;
+		size_t maxKeys; /* 0 for no limit */
+		size_t evictCursor;
+		size_t sweepCursor;
+		size_t sweepPending; /* buckets left to sweep */
+		TrackedPrefixMap_t prefixes;
+		int pendingPrefixes; /* prefixes with keys to send */
+		EventLoop* eventLoop;
+		long hookId;
+
+		TrackedKey* find(const char* key, size_t len, size_t hash) const;
+		void rehash();
+		void dropKey(TrackedKey* entry, Client* by);
+		void evictKey();
+		int isTracking(long long id) const;
+		void sweep(size_t buckets);
+		void sendInvalidation(Client* c, const std::vector<const sds_t*>& keys);
+		static int beforeSleep(EventLoop* eventLoop, void* clientData, long long deadline);
+	public:
+		long long invalidations; /* push messages sent */
+		long long evictions;     /* keys invalidated to stay under maxKeys */
+
+		TrackingTable(ClientManager* manager);
+		~TrackingTable();
+
+		int attach(EventLoop* eventLoop);
+		void detach();
+		int attached() const{
+			return this->eventLoop != NULL;
+		}
+
+		void enable(Client* c, int bcast, const std::vector<sds_t>& prefixes, int noloop);
+		void disable(Client* c);
+		void rememberKey(Client* c, const char* key, size_t len);
+		void invalidateKey(const char* key, size_t len, Client* by);
+		void flushBroadcasts();
+		void setMaxKeys(size_t maxKeys){
+			this->maxKeys = maxKeys;
+		}
+		size_t getMaxKeys() const{
+			return this->maxKeys;
+		}
+		size_t size() const{
+			return this->count;
+		}
+	};
+}
+
+#endif // _REDIS_REDISCPP_TRACKING_H_
@@ -39,6 +39,12 @@
 #include <float.h>
 
 #include "util.h"
+#include "config.h"
+
+#ifdef HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
 namespace redis{
 	/* Glob-style pattern matching. */
 	int stringmatchlen(const char *pattern, int patternLen,
@@ -405,6 +411,135 @@ namespace redis{
 		fclose(fp);
 	}
 
+	/* Delimiter scanning for the protocol parsers. memchr() is already
+	* vectorized by the C library, but the searches below are not single
+	* bytes: a CR followed by LF, and a space or a tab. Each has a scalar
+	* version, and SSE2 and AVX2 ones picked by the first call according
+	* to the CPU. The vector loops never read past 's+len'. */
+	typedef const char *ScanProc_t(const char *s, size_t len);
+
+	static const char *memcrlfScalar(const char *s, size_t len) {
+		const char *end = s + len;
+		while (len > 1) {
+			const char *cr = (const char*)memchr(s,'\r',len-1);
+			if (cr == NULL) return NULL;
+			if (cr[1] == '\n') return cr;
+			s = cr + 1;
+			len = end - s;
+		}
+		return NULL;
+	}
+
+	static const char *memblankScalar(const char *s, size_t len) {
+		for (size_t j = 0; j < len; j++)
+			if (s[j] == ' ' || s[j] == '\t') return s + j;
+		return NULL;
+	}
+
+#ifdef HAVE_X86_SIMD
+	/* A CRLF starts at j when s[j] is CR and s[j+1] is LF: compare the
+	* block at j with CR and the block at j+1 with LF. */
+	__attribute__((target("sse2")))
+	static const char *memcrlfSSE2(const char *s, size_t len) {
+		const __m128i cr = _mm_set1_epi8('\r'), lf = _mm_set1_epi8('\n');
+		size_t j = 0;
+		for (; j + 17 <= len; j += 16) {
+			__m128i a = _mm_loadu_si128((const __m128i*)(s+j));
+			__m128i b = _mm_loadu_si128((const __m128i*)(s+j+1));
+			int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a,cr),_mm_cmpeq_epi8(b,lf)));
+			if (mask) return s + j + __builtin_ctz(mask);
+		}
+		return memcrlfScalar(s+j,len-j);
+	}
+
+	__attribute__((target("avx2")))
+	static const char *memcrlfAVX2(const char *s, size_t len) {
+		const __m256i cr = _mm256_set1_epi8('\r'), lf = _mm256_set1_epi8('\n');
+		size_t j = 0;
+		for (; j + 33 <= len; j += 32) {
+			__m256i a = _mm256_loadu_si256((const __m256i*)(s+j));
+			__m256i b = _mm256_loadu_si256((const __m256i*)(s+j+1));
+			unsigned mask = (unsigned)_mm256_movemask_epi8(
+				_mm256_and_si256(_mm256_cmpeq_epi8(a,cr),_mm256_cmpeq_epi8(b,lf)));
+			if (mask) return s + j + __builtin_ctz(mask);
+		}
+		return memcrlfSSE2(s+j,len-j);
+	}
+
+	__attribute__((target("sse2")))
+	static const char *memblankSSE2(const char *s, size_t len) {
+		const __m128i sp = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t');
+		size_t j = 0;
+		for (; j + 16 <= len; j += 16) {
+			__m128i a = _mm_loadu_si128((const __m128i*)(s+j));
+			int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(a,sp),_mm_cmpeq_epi8(a,tab)));
+			if (mask) return s + j + __builtin_ctz(mask);
+		}
+		const char *p = memblankScalar(s+j,len-j);
+		return p;
+	}
+
+	__attribute__((target("avx2")))
+	static const char *memblankAVX2(const char *s, size_t len) {
+		const __m256i sp = _mm256_set1_epi8(' '), tab = _mm256_set1_epi8('\t');
+		size_t j = 0;
+		for (; j + 32 <= len; j += 32) {
+			__m256i a = _mm256_loadu_si256((const __m256i*)(s+j));
+			unsigned mask = (unsigned)_mm256_movemask_epi8(
+				_mm256_or_si256(_mm256_cmpeq_epi8(a,sp),_mm256_cmpeq_epi8(a,tab)));
+			if (mask) return s + j + __builtin_ctz(mask);
+		}
+		return memblankSSE2(s+j,len-j);
+	}
+#endif
+
+	static ScanProc_t *scanPick(ScanProc_t *scalar, ScanProc_t *sse2, ScanProc_t *avx2) {
+#ifdef HAVE_X86_SIMD
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2")) return avx2;
+		if (__builtin_cpu_supports("sse2")) return sse2;
+#else
+		(void)sse2; (void)avx2;
+#endif
+		return scalar;
+	}
+
+	static const char *memcrlfResolve(const char *s, size_t len);
+	static const char *memblankResolve(const char *s, size_t len);
+	/* Every thread resolves to the same function: the race is harmless */
+	static ScanProc_t *memcrlfProc = memcrlfResolve;
+	static ScanProc_t *memblankProc = memblankResolve;
+
+	static const char *memcrlfResolve(const char *s, size_t len) {
+#ifdef HAVE_X86_SIMD
+		memcrlfProc = scanPick(memcrlfScalar,memcrlfSSE2,memcrlfAVX2);
+#else
+		memcrlfProc = memcrlfScalar;
+#endif
+		return memcrlfProc(s,len);
+	}
+
+	static const char *memblankResolve(const char *s, size_t len) {
+#ifdef HAVE_X86_SIMD
+		memblankProc = scanPick(memblankScalar,memblankSSE2,memblankAVX2);
+#else
+		memblankProc = memblankScalar;
+#endif
+		return memblankProc(s,len);
+	}
+
+	/* Return a pointer to the first "\r\n" of the 'len' bytes at 's', or
+	* NULL. */
+	const char *memcrlf(const char *s, size_t len) {
+		return memcrlfProc(s,len);
+	}
+
+	/* Return a pointer to the first space or tab of the 'len' bytes at 's',
+	* or NULL. */
+	const char *memblank(const char *s, size_t len) {
+		return memblankProc(s,len);
+	}
+
 #ifdef UTIL_TEST_MAIN
 #include <assert.h>
 
@@ -512,9 +647,36 @@ namespace redis{
 #endif
 	}
 
+	void test_scan(void) {
+		char buf[200];
+		ScanProc_t *crlf[] = {memcrlfScalar,memcrlf};
+		ScanProc_t *blank[] = {memblankScalar,memblank};
+
+		for (int k = 0; k < 2; k++) {
+			/* Every position and length, across the vector boundaries */
+			for (size_t len = 0; len <= 100; len++) {
+				for (size_t at = 0; at + 1 < len; at++) {
+					memset(buf,'x',sizeof(buf));
+					buf[at] = '\r';
+					buf[at+1] = '\n';
+					assert(crlf[k](buf,len) == buf+at);
+					assert(crlf[k](buf,at+1) == NULL);
+					buf[at] = (at & 1) ? ' ' : '\t';
+					assert(blank[k](buf,len) == buf+at);
+					assert(blank[k](buf,at) == NULL);
+				}
+			}
+			/* A lone CR, and a CRLF split at the end */
+			strcpy(buf,"$3\rfoo\r\n");
+			assert(crlf[k](buf,strlen(buf)) == buf+6);
+			assert(crlf[k](buf,strlen(buf)-1) == NULL);
+		}
+	}
+
 	int main(int argc, char **argv) {
 		test_string2ll();
 		test_string2l();
+		test_scan();
 		return 0;
 	}
 #endif
@@ -30,6 +30,7 @@
 #ifndef __REDIS_UTIL_H
 #define __REDIS_UTIL_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 namespace redis{
@@ -40,6 +41,8 @@ namespace redis{
 	int string2ll(const char *s, size_t slen, long *value);
 	int string2l(const char *s, size_t slen, long *value);
 	int d2string(char *buf, size_t len, double value);
+	const char *memcrlf(const char *s, size_t len);
+	const char *memblank(const char *s, size_t len);
 	//
 	uint64_t crc64(uint64_t crc, const unsigned char *s, uint64_t l);
 }
@@ -126,8 +126,8 @@ namespace redis{
 		}
 
 		void destroy(pointer ptr)
-		{	
-			zfree(ptr);
+		{	// destroy object at ptr, the storage goes with deallocate()
+			ptr->~T();
 		}
 
 		size_t max_size() const